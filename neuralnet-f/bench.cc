@@ -0,0 +1,371 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Benchmarks of matrix.hh and nn.hh, for the shapes that
+// idx::run<28,28,10,100,4,30> (run_mnist in main.cc) works with.
+//
+//     bench [--filter=<substring>] [--min-time=<seconds>] [--json]
+//
+// Every case is timed for at least --min-time seconds. Besides the time
+// per call, it reports:
+//
+// - GFLOP/s: multiply-adds count as two, activation functions are not counted.
+// - bytes:   what a call must read and write at least (operands once,
+//            results once). Caches may make actual traffic lower.
+// - ns per sample: time per call divided by the records it handles.
+//
+// --json writes the results in the format of Google Benchmark's JSON
+// reporter (with the above as user counters) to stdout, so that they
+// can be kept and compared across versions.
+
+#include "common.hh"
+#include "matrix.hh"
+#include "nn.hh"
+#include "optim.hh"
+#include "rng.hh"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace {
+
+    struct result {
+        std::string name;
+        size_t      iterations;
+        double      seconds;  ///< Per iteration.
+        double      flop;     ///< Per iteration.
+        double      bytes;    ///< Per iteration.
+        uint        samples;  ///< Per iteration.
+    };
+
+    struct {
+        std::string filter;
+        double      min_time = 0.2;
+        bool        json     = false;
+    } options;
+
+    std::vector<result> results;
+
+    rng::xoshiro256ss random(1);
+
+    template<typename M>
+    void randomize(M &m) {
+        using T = typename M::value_type;
+        m.mip([](auto) { return rng::uniform<T>(random, -1, 1); });
+    }
+
+    template<typename T>
+    const char *type_name() { return sizeof(T) == 4 ? "f32" : "f64"; }
+
+    template<typename F>
+    void keep(F &&f) {
+        f();
+        // Make the compiler assume that f's results are read.
+        asm volatile("" ::: "memory");
+    }
+
+    /**
+     * \brief Time f, and record the result.
+     *
+     * \param flop    Per call.
+     * \param bytes   Per call, see the top of this file.
+     * \param samples Records per call (1 if that does not apply).
+     * \return false if f was filtered out (and not called).
+     */
+    template<typename F>
+    bool measure(const std::string &name, double flop, double bytes, uint samples, F f) {
+        if (!options.filter.empty() && name.find(options.filter) == std::string::npos)
+            return false;
+
+        using clock = std::chrono::steady_clock;
+        keep(f); // warm up.
+        size_t n = 1;
+        for (;;) {
+            auto t0 = clock::now();
+            for (size_t i = 0; i < n; ++i)
+                keep(f);
+            std::chrono::duration<double> dt = clock::now() - t0;
+            if (dt.count() > options.min_time) {
+                results.push_back({ name, n, dt.count() / n, flop, bytes, samples });
+                break;
+            }
+            n *= 2;
+        }
+
+        if (!options.json) {
+            const result &r = results.back();
+            std::printf("%-44s %12.0f ns", r.name.c_str(), r.seconds * 1e9);
+            if (r.flop)
+                std::printf("  %7.2f GFLOP/s", r.flop / r.seconds / 1e9);
+            else
+                std::printf("  %15s", "");
+            std::printf("  %10.0f bytes  %9.1f ns/sample\n",
+                        r.bytes, r.seconds * 1e9 / r.samples);
+        }
+        return true;
+    }
+
+    void report_json() {
+        char date[32];
+        std::time_t now = std::time(nullptr);
+        std::strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%S%z", std::localtime(&now));
+
+        std::printf("{\n"
+                    "  \"context\": {\n"
+                    "    \"date\": \"%s\",\n"
+                    "    \"executable\": \"neuralnet-f/bench\",\n"
+                    "    \"compiler\": \"%s\",\n"
+                    "    \"simd_bytes\": %zu,\n"
+                    "    \"gemm\": { \"f32\": { \"MR\": %u, \"NR\": %u }, \"f64\": { \"MR\": %u, \"NR\": %u } }\n"
+                    "  },\n"
+                    "  \"benchmarks\": [",
+                    date, __VERSION__, simd::bytes,
+                    gemm::params<float>::MR,  gemm::params<float>::NR,
+                    gemm::params<double>::MR, gemm::params<double>::NR);
+
+        for (size_t i = 0; i < results.size(); ++i) {
+            const result &r = results[i];
+            std::printf("%s\n    {\n"
+                        "      \"name\": \"%s\",\n"
+                        "      \"run_type\": \"iteration\",\n"
+                        "      \"iterations\": %zu,\n"
+                        "      \"real_time\": %.3f,\n"
+                        "      \"time_unit\": \"ns\",\n"
+                        "      \"flop\": %.0f,\n"
+                        "      \"FLOP/s\": %.6e,\n"
+                        "      \"bytes\": %.0f,\n"
+                        "      \"bytes_per_second\": %.6e,\n"
+                        "      \"samples\": %u,\n"
+                        "      \"ns_per_sample\": %.3f\n"
+                        "    }",
+                        i ? "," : "",
+                        r.name.c_str(), r.iterations, r.seconds * 1e9,
+                        r.flop, r.flop / r.seconds,
+                        r.bytes, r.bytes / r.seconds,
+                        r.samples, r.seconds * 1e9 / r.samples);
+        }
+        std::printf("\n  ]\n}\n");
+    }
+
+    // Matrix operations. {{{
+
+    template<typename T1, uint rows, uint cols, uint bCols>
+    void reference_dot(const Matrix<T1,rows,cols>  &a,
+                       const Matrix<T1,cols,bCols> &b,
+                             Matrix<T1,rows,bCols> &c) {
+        for (uint cRow = 1; cRow <= rows; cRow++) {
+            for (uint cCol = 1; cCol <= bCols; cCol++) {
+                T1 sum = 0;
+                for (uint i = 1; i <= cols; i++)
+                    sum += a(cRow, i) * b(i, cCol);
+                c(cRow, cCol) = sum;
+            }
+        }
+    }
+
+    /**
+     * \brief Matrix::dot for one shape, and (with `reference`) the plain
+     *        i-j-k loop it replaced.
+     */
+    template<typename T, uint M, uint K, uint N>
+    void bench_dot(bool reference = false) {
+        // Keep these off the stack; the first layer operands are big.
+        auto a = std::make_unique<Matrix<T,M,K>>();
+        auto b = std::make_unique<Matrix<T,K,N>>();
+        auto c = std::make_unique<Matrix<T,M,N>>();
+        randomize(*a);
+        randomize(*b);
+
+        std::string shape = std::to_string(M) + "x" + std::to_string(K) + "x" + std::to_string(N);
+        double flop  = 2.0 * M * N * K;
+        double bytes = sizeof(T) * (double(M) * K + double(K) * N + double(M) * N);
+
+        bool ran = measure(std::string("dot/") + type_name<T>() + "/" + shape, flop, bytes, 1,
+                           [&] { *c = a->dot(*b); });
+
+        if (reference) {
+            auto r = std::make_unique<Matrix<T,M,N>>();
+            // Only compare when both have run.
+            if (!measure(std::string("dot_reference/") + type_name<T>() + "/" + shape, flop, bytes, 1,
+                         [&] { reference_dot(*a, *b, *r); }) || !ran)
+                return;
+
+            double err = 0;
+            for (size_t i = 0; i < r->size(); ++i)
+                err = std::max(err, double(std::abs(r->data()[i] - c->data()[i])));
+            if (err > 1e-3)
+                std::fprintf(stderr, "dot %s differs from the reference by %g\n", shape.c_str(), err);
+        }
+    }
+
+    template<typename T, uint M, uint N>
+    void bench_elementwise() {
+        Matrix<T,M,N> a;
+        Matrix<T,N,M> t;
+        Matrix<T,M,N> c;
+        randomize(a);
+
+        std::string shape = std::string(type_name<T>()) + "/" + std::to_string(M) + "x" + std::to_string(N);
+        double bytes = 2.0 * sizeof(T) * M * N;
+
+        measure("transpose/" + shape, 0, bytes, M, [&] { t = a.T(); });
+        measure("map/sigma/" + shape, 0, bytes, M, [&] { c = a.map(nn::g); });
+        measure("mip/sigma/" + shape, 0, bytes, M, [&] { c.mip(nn::g); });
+        measure("map/sigma_/" + shape, 0, bytes, M, [&] { c = a.map(nn::g_); });
+    }
+
+    // }}}
+    // Nets. {{{
+
+    /// Sizes of the layers of a net (inputs first).
+    template<typename Net, size_t... Is>
+    std::vector<double> layer_sizes(std::index_sequence<Is...>) {
+        return { double(std::tuple_element_t<0, Net>::nrows),
+                 double(std::tuple_element_t<2*Is, Net>::ncols)... };
+    }
+
+    template<typename Net>
+    std::vector<double> layer_sizes() {
+        return layer_sizes<Net>(std::make_index_sequence<std::tuple_size<Net>::value / 2> { });
+    }
+
+    template<typename T, uint B, uint I, uint O, uint H, uint N>
+    void bench_net() {
+        using Net = nn::make_net<T,I,O,H,N>;
+
+        Net net;
+        nn::for_each_layer(net, [](auto &W, auto &b) { randomize(W); randomize(b); });
+
+        auto X = std::make_unique<Matrix<T,B,I>>();
+        auto X1 = std::make_unique<Matrix<T,1,I>>();
+        auto Y = std::make_unique<Matrix<T,B,O>>();
+        randomize(*X);
+        randomize(*X1);
+        for (uint r = 1; r <= B; ++r)
+            (*Y)(r, 1 + r % O) = 1;
+
+        std::string shape = std::string(type_name<T>()) + "/" + std::to_string(I)
+                          + "-" + std::to_string(H) + "x" + std::to_string(N)
+                          + "-" + std::to_string(O);
+
+        // FLOP of one layer's product per record, and its weights and biases.
+        auto sizes = layer_sizes<Net>();
+        double layer_flop = 0, weights = 0;
+        for (size_t l = 0; l + 1 < sizes.size(); ++l) {
+            layer_flop += 2 * sizes[l] * sizes[l+1];
+            weights    += (sizes[l] + 1) * sizes[l+1];
+        }
+        // Backpropagation: a weight delta for every layer, an input delta for all but the first.
+        double backward_flop = 2 * layer_flop - 2 * sizes[0] * sizes[1];
+
+        auto forward_bytes = [&](uint b) { return sizeof(T) * (weights + b * (double(I) + O)); };
+        // Weights are read and written; the expected outputs are read as well.
+        double train_bytes = sizeof(T) * (2 * weights + B * (double(I) + O));
+
+        {
+            Matrix<T,B,N> A;
+            auto &W = std::get<0>(net);
+            auto &b = std::get<1>(net);
+            measure("forward_one/" + shape + "/b" + std::to_string(B),
+                    2.0 * B * I * N, sizeof(T) * ((I + 1.0) * N + B * (double(I) + N)), B,
+                    [&] { A = nn::forward_one(*X, W, b); });
+        }
+
+        Matrix<T,B,O> A;
+        measure("forwards/" + shape + "/b" + std::to_string(B),
+                B * layer_flop, forward_bytes(B), B,
+                [&] { A = std::apply([&](const auto&... Ws) { return nn::forwards(*X, Ws...); }, net); });
+
+        Matrix<T,1,O> A1;
+        measure("forwards/" + shape + "/b1",
+                layer_flop, forward_bytes(1), 1,
+                [&] { A1 = std::apply([&](const auto&... Ws) { return nn::forwards(*X1, Ws...); }, net); });
+
+        measure("forwards/softmax/" + shape + "/b" + std::to_string(B),
+                B * layer_flop, forward_bytes(B), B,
+                [&] {
+                    A = std::apply([&](const auto&... Ws) {
+                        return nn::forwards<nn::softmax_cross_entropy>(*X, Ws...);
+                    }, net);
+                });
+
+        // Train on copies, so that every case starts from the same weights.
+        Net sgd_net = net;
+        measure("train/sgd/" + shape + "/b" + std::to_string(B),
+                B * (layer_flop + backward_flop), train_bytes, B,
+                [&] { std::apply([&](auto&... Ws) { nn::train(*X, *Y, Ws...); }, sgd_net); });
+
+        // As run_mnist in main.cc trains.
+        Net adam_net = net;
+        optim::optimizer<Net, optim::adam> adam;
+        measure("train/adam/softmax/" + shape + "/b" + std::to_string(B),
+                B * (layer_flop + backward_flop), train_bytes + sizeof(T) * 2 * 2 * weights, B,
+                [&] { adam.template train<nn::softmax_cross_entropy>(*X, *Y, adam_net); });
+    }
+
+    // }}}
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strncmp(argv[i], "--filter=", 9)) {
+            options.filter = argv[i] + 9;
+        } else if (!std::strncmp(argv[i], "--min-time=", 11)) {
+            options.min_time = std::stod(argv[i] + 11);
+        } else if (!std::strcmp(argv[i], "--json")) {
+            options.json = true;
+        } else {
+            std::fprintf(stderr, "usage: %s [--filter=<substring>] [--min-time=<seconds>] [--json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Forward pass.
+    bench_dot<double, 100, 784,  30>(true);
+    bench_dot<double, 100,  30,  30>(true);
+    bench_dot<double, 100,  30,  10>(true);
+    bench_dot<float,  100, 784,  30>();
+    bench_dot<float,  100,  30,  30>();
+    bench_dot<float,  100,  30,  10>();
+
+    // Backward pass: deltas (D * W^T) and weight updates (A^T * D).
+    bench_dot<double, 100,  30, 784>(true);
+    bench_dot<double, 100,  10,  30>(true);
+    bench_dot<double, 784, 100,  30>(true);
+    bench_dot<double,  30, 100,  30>(true);
+    bench_dot<double,  30, 100,  10>(true);
+    bench_dot<float,  100,  30, 784>();
+    bench_dot<float,  784, 100,  30>();
+
+    bench_elementwise<float,  100,  30>();
+    bench_elementwise<float,  100, 784>();
+    bench_elementwise<double, 100,  30>();
+
+    // The net of run_mnist, and its shape in idx::run's defaults.
+    bench_net<float,  100, 28*28, 10, 4, 30>();
+    bench_net<double, 100, 28*28, 10, 4, 30>();
+
+    if (options.json)
+        report_json();
+
+    return 0;
+}
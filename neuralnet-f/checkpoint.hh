@@ -0,0 +1,267 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief Binary checkpoints of nets made with nn::make_net.
+ *
+ * Layout (all integers in the byte order of the machine that wrote it,
+ * which is recorded and checked):
+ *
+ *     header      64 bytes, see checkpoint::header
+ *     layers      one checkpoint::layer per matrix (weights and biases), input side first
+ *     (padding)
+ *     weights     row-major elements of each matrix, each blob starting
+ *                 at a multiple of 64 bytes
+ *
+ * A checkpoint can be loaded into a net (checkpoint::load), or mapped
+ * read-only and used in place (checkpoint::mapped). Mapped weights are
+ * shared between all processes that map the same file.
+ */
+
+#include "common.hh"
+#include "matrix.hh"
+#include "mapped_file.hh"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace checkpoint {
+
+    constexpr char     magic[8]   = { 'N','N','F','C','K','P','T','\0' };
+    constexpr uint32_t version    = 1;
+    constexpr uint32_t byte_order = 0x01020304;
+    constexpr size_t   alignment  = 64;
+
+    /// Element type codes.
+    template<typename T> constexpr uint32_t element_code = 0;
+    template<> constexpr uint32_t element_code<float>  = 1;
+    template<> constexpr uint32_t element_code<double> = 2;
+    template<> constexpr uint32_t element_code<half::bf16> = 3;
+    template<> constexpr uint32_t element_code<half::fp16> = 4;
+
+    struct header {
+        char     magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t element;    ///< See element_code.
+        uint32_t layers;     ///< Amount of matrices.
+        uint64_t size;       ///< Size of the whole file in bytes.
+        uint8_t  reserved[32];
+    };
+    static_assert(sizeof(header) == 64, "checkpoint header must be 64 bytes");
+
+    struct layer {
+        uint32_t rows;
+        uint32_t cols;
+        uint64_t offset;     ///< Of the elements, from the start of the file.
+    };
+    static_assert(sizeof(layer) == 16, "checkpoint layer entry must be 16 bytes");
+
+    namespace detail {
+        constexpr uint64_t align(uint64_t x) {
+            return (x + alignment - 1) / alignment * alignment;
+        }
+
+        /**
+         * \brief A view on the elements of a W, as stored in a checkpoint.
+         *
+         * Weights that are more than a Matrix (e.g. nn::conv_weights)
+         * have a `rebind` to the same kind of weights, stored elsewhere.
+         */
+        template<typename W, typename = void>
+        struct view_of {
+            using type = MatrixView<typename W::value_type, W::nrows, W::ncols>;
+        };
+
+        template<typename W>
+        struct view_of<W, std::void_t<typename W::template rebind<Matrix<typename W::value_type, 1, 1>>>> {
+            using type = typename W::template rebind<MatrixView<typename W::value_type, W::nrows, W::ncols>>;
+        };
+
+        template<typename Net>
+        struct traits;
+
+        template<typename W1, typename... WsT>
+        struct traits<std::tuple<W1, WsT...>> {
+            using value_type = typename W1::value_type;
+            using views_type = std::tuple<typename view_of<W1>::type, typename view_of<WsT>::type...>;
+
+            static_assert((std::is_same<typename WsT::value_type, value_type>::value && ...),
+                          "All matrices of a checkpoint must have the same element type");
+            static_assert(element_code<value_type> != 0, "No checkpoint element code for this type");
+
+            static constexpr uint32_t count = 1 + sizeof...(WsT);
+
+            /// The expected layer table.
+            static std::vector<layer> layers() {
+                std::vector<layer> ls { layer { W1::nrows, W1::ncols, 0 },
+                                        layer { WsT::nrows, WsT::ncols, 0 }... };
+                uint64_t offset = align(sizeof(header) + sizeof(layer) * count);
+                for (auto &l : ls) {
+                    l.offset = offset;
+                    offset = align(offset + uint64_t(l.rows) * l.cols * sizeof(value_type));
+                }
+                return ls;
+            }
+
+            template<size_t... Is>
+            static views_type views(const unsigned char *base,
+                                    const std::vector<layer> &ls,
+                                    std::index_sequence<Is...>) {
+                return views_type { std::tuple_element_t<Is, views_type>(
+                        reinterpret_cast<const value_type*>(base + ls[Is].offset))... };
+            }
+        };
+
+        /// Check the header and layer table against what Net expects.
+        template<typename Net>
+        std::vector<layer> verify(const mapped_file &f) {
+            using Tr = traits<Net>;
+
+            header h;
+            if (f.size() < sizeof h)
+                throw std::runtime_error("checkpoint is too short");
+            std::memcpy(&h, f.data(), sizeof h);
+
+            if (std::memcmp(h.magic, magic, sizeof magic))
+                throw std::runtime_error("not a checkpoint");
+            if (h.byte_order != byte_order)
+                throw std::runtime_error("checkpoint was written with a different byte order");
+            if (h.version == 0 || h.version > version)
+                throw std::runtime_error("unsupported checkpoint version");
+            if (h.size != f.size())
+                throw std::runtime_error("checkpoint is truncated");
+            if (h.element != element_code<typename Tr::value_type>)
+                throw std::runtime_error("checkpoint element type mismatch");
+            if (h.layers != Tr::count)
+                throw std::runtime_error("checkpoint layer count mismatch");
+
+            auto expected = Tr::layers();
+            std::vector<layer> ls(Tr::count);
+            if (f.size() < sizeof h + sizeof(layer) * ls.size())
+                throw std::runtime_error("checkpoint is too short");
+            std::memcpy(ls.data(), f.data() + sizeof h, sizeof(layer) * ls.size());
+
+            for (size_t i = 0; i < ls.size(); ++i) {
+                if (ls[i].rows != expected[i].rows || ls[i].cols != expected[i].cols)
+                    throw std::runtime_error("checkpoint layer " + std::to_string(i)
+                                             + " has the wrong shape");
+                if (ls[i].offset % alignment
+                    || ls[i].offset + uint64_t(ls[i].rows) * ls[i].cols
+                                      * sizeof(typename Tr::value_type) > f.size())
+                    throw std::runtime_error("checkpoint layer " + std::to_string(i)
+                                             + " is out of bounds");
+            }
+            return ls;
+        }
+    }
+
+    /**
+     * \brief Write a net to a checkpoint file.
+     *
+     * The file is written next to its destination and then renamed over
+     * it, so readers (and mappings) never see a half-written checkpoint.
+     */
+    template<typename Net>
+    void save(std::string_view filename, const Net &net) {
+        using Tr = detail::traits<Net>;
+        using T  = typename Tr::value_type;
+
+        auto ls = Tr::layers();
+
+        header h { };
+        std::memcpy(h.magic, magic, sizeof magic);
+        h.version    = version;
+        h.byte_order = byte_order;
+        h.element    = element_code<T>;
+        h.layers     = Tr::count;
+        h.size       = ls.back().offset + uint64_t(ls.back().rows) * ls.back().cols * sizeof(T);
+
+        std::string tmp = std::string(filename) + ".tmp";
+        {
+            std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+            if (!file)
+                throw std::runtime_error("Could not open " + tmp);
+
+            file.write((const char*)&h, sizeof h);
+            file.write((const char*)ls.data(), sizeof(layer) * ls.size());
+
+            uint64_t pos = sizeof h + sizeof(layer) * ls.size();
+            size_t i = 0;
+            std::apply([&](const auto&... W) {
+                ([&](const auto &w) {
+                    static const char zeroes[alignment] = { };
+                    file.write(zeroes, ls[i].offset - pos);
+                    file.write((const char*)w.data(), sizeof(T) * w.size());
+                    pos = ls[i].offset + sizeof(T) * w.size();
+                    ++i;
+                }(W), ...);
+            }, net);
+
+            if (!file.flush())
+                throw std::runtime_error("Could not write " + tmp);
+        }
+        if (std::rename(tmp.c_str(), std::string(filename).c_str()))
+            throw std::runtime_error("Could not replace " + std::string(filename));
+    }
+
+    /**
+     * \brief A read-only, memory-mapped checkpoint.
+     *
+     * net() gives a tuple of MatrixViews with the same shapes as Net,
+     * which can be passed to nn::forwards like the net itself.
+     */
+    template<typename Net>
+    class mapped {
+        using Tr = detail::traits<Net>;
+
+        mapped_file              file;
+        typename Tr::views_type  views;
+
+    public:
+        explicit mapped(std::string_view filename)
+            : file(filename),
+              views(Tr::views(file.data(),
+                              detail::verify<Net>(file),
+                              std::make_index_sequence<Tr::count> { }))
+            { }
+
+        const typename Tr::views_type &net() const { return views; }
+
+        /// A copy of the weights, e.g. to continue training.
+        Net copy() const {
+            return std::apply([](const auto&... W) { return Net { W.eval()... }; }, views);
+        }
+    };
+
+    /**
+     * \brief Read a net from a checkpoint file.
+     */
+    template<typename Net>
+    Net load(std::string_view filename) {
+        return mapped<Net>(filename).copy();
+    }
+}
@@ -0,0 +1,241 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief Turn a trained net into a standalone C++ header.
+ *
+ * The generated header needs nothing but the standard library: the
+ * weights are aligned constexpr arrays, and the forward pass is plain
+ * code written for the shapes of this one net. Small layers are
+ * unrolled completely, bigger ones become loops with constant bounds
+ * (which the compiler vectorizes). A call allocates nothing, and there
+ * is nothing to load or initialize before the first one.
+ *
+ * The generated run() computes the same as nn::forwards<Out>, up to
+ * rounding (it uses std::exp rather than simd::exp).
+ */
+
+#include "common.hh"
+#include "matrix.hh"
+#include "nn.hh"
+#include <cmath>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace codegen {
+
+    struct options {
+        /// Namespace of the generated code.
+        std::string name = "net";
+
+        /// Where the weights came from, for the header comment.
+        std::string source;
+
+        /// Layers with at most this many weights are unrolled.
+        uint unroll = 256;
+    };
+
+    namespace detail {
+
+        template<typename T>
+        const char *type_name() {
+            static_assert(std::is_same<T,float>::value || std::is_same<T,double>::value,
+                          "Only float and double nets can be generated");
+            return std::is_same<T,float>::value ? "float" : "double";
+        }
+
+        /// A literal that reads back as exactly x.
+        template<typename T>
+        void literal(std::ostream &o, T x) {
+            std::ostringstream s;
+            s.precision(std::numeric_limits<T>::max_digits10);
+            s << x;
+            o << s.str();
+            if (s.str().find_first_of(".e") == std::string::npos)
+                o << ".0";
+            if (std::is_same<T,float>::value)
+                o << 'f';
+        }
+
+        /// Throw if M has a NaN or infinity, which has no literal.
+        template<typename MT>
+        void check_finite(const std::string &name, const MT &M) {
+            for (size_t i = 0; i < MT::size(); ++i) {
+                if (!std::isfinite(M.data()[i]))
+                    throw std::invalid_argument("Cannot generate a net with non-finite weights (in "
+                                                + name + ")");
+            }
+        }
+
+        template<typename MT>
+        void array(std::ostream &o, const std::string &name, const MT &M) {
+            using T = typename MT::value_type;
+
+            o << "    alignas(64) constexpr " << type_name<T>() << " " << name
+              << "[" << MT::size() << "] = {";
+            for (size_t i = 0; i < MT::size(); ++i) {
+                o << (i % 8 ? " " : "\n        ");
+                literal(o, M.data()[i]);
+                o << ",";
+            }
+            o << "\n    };\n";
+        }
+
+        /**
+         * \brief y = f(x W + b) for one layer, with x, y, W and b the
+         *        names of arrays in the generated code.
+         */
+        template<typename WT>
+        void layer(std::ostream &o, const options &opt,
+                   const std::string &x, const std::string &y,
+                   const std::string &W, const std::string &b,
+                   const char *f) {
+            constexpr uint I = WT::nrows;
+            constexpr uint O = WT::ncols;
+
+            if (I * O <= opt.unroll) {
+                for (uint j = 0; j < O; ++j) {
+                    o << "        " << y << "[" << j << "] = " << f << "(" << b << "[" << j << "]";
+                    for (uint i = 0; i < I; ++i)
+                        o << "\n            + " << x << "[" << i << "] * " << W << "[" << i * O + j << "]";
+                    o << ");\n";
+                }
+            } else {
+                o << "        for (unsigned j = 0; j < " << O << "; ++j)\n"
+                  << "            " << y << "[j] = " << b << "[j];\n"
+                  << "        for (unsigned i = 0; i < " << I << "; ++i)\n"
+                  << "            for (unsigned j = 0; j < " << O << "; ++j)\n"
+                  << "                " << y << "[j] += " << x << "[i] * " << W << "[i * " << O << " + j];\n"
+                  << "        for (unsigned j = 0; j < " << O << "; ++j)\n"
+                  << "            " << y << "[j] = " << f << "(" << y << "[j]);\n";
+            }
+        }
+
+        /// The code for layer I of the forward pass.
+        template<typename Out, typename Net, size_t I>
+        void forward(std::ostream &o, const options &opt) {
+            using WT = std::decay_t<std::tuple_element_t<2*I, Net>>;
+            using T  = typename WT::value_type;
+
+            constexpr bool last = I + 1 == std::tuple_size<Net>::value / 2;
+
+            // Activations of layer I go in a<I>, those of the output layer in y.
+            std::string x = I ? "a" + std::to_string(I) : "x";
+            std::string y = last ? "y" : "a" + std::to_string(I + 1);
+
+            o << "        // Layer " << I + 1 << ": " << WT::nrows << " -> " << WT::ncols << ".\n";
+            if (!last)
+                o << "        " << type_name<T>() << " " << y << "[" << WT::ncols << "];\n";
+
+            bool logits = last && std::is_same<Out, nn::softmax_cross_entropy>::value;
+            layer<WT>(o, opt, x, y, "W" + std::to_string(I), "b" + std::to_string(I),
+                      logits ? "identity" : "sigmoid");
+        }
+
+        template<typename Out, typename Net, size_t... Is>
+        void emit(std::ostream &o, const Net &net, const options &opt, std::index_sequence<Is...>) {
+            using W1T = std::tuple_element_t<0, Net>;
+            using WLT = std::tuple_element_t<std::tuple_size<Net>::value - 2, Net>;
+            using T   = typename W1T::value_type;
+
+            static_assert((nn::layer_traits<std::decay_t<std::tuple_element_t<2*Is, Net>>>::dense && ...),
+                          "Only fully connected nets can be generated");
+            static_assert(std::is_same<Out, nn::sigmoid_mse>::value
+                          || std::is_same<Out, nn::softmax_cross_entropy>::value,
+                          "Unknown output layer");
+
+            constexpr bool softmax = std::is_same<Out, nn::softmax_cross_entropy>::value;
+            const char    *t       = type_name<T>();
+
+            // Before writing anything.
+            (check_finite("W" + std::to_string(Is), std::get<2*Is>(net)), ...);
+            (check_finite("b" + std::to_string(Is), std::get<2*Is+1>(net)), ...);
+
+            o << "// Generated by neuralnet-f";
+            if (!opt.source.empty())
+                o << " from " << opt.source;
+            o << ". Do not edit.\n"
+              << "#pragma once\n\n"
+              << "#include <cmath>\n"
+              << "#include <cstddef>\n\n"
+              << "namespace " << opt.name << " {\n\n"
+              << "    constexpr unsigned inputs  = " << W1T::nrows << ";\n"
+              << "    constexpr unsigned outputs = " << WLT::ncols << ";\n\n";
+
+            // Weights and biases, input side first.
+            ((array(o, "W" + std::to_string(Is), std::get<2*Is>(net)),
+              array(o, "b" + std::to_string(Is), std::get<2*Is+1>(net)),
+              o << "\n"), ...);
+
+            o << "    inline " << t << " sigmoid(" << t << " x) { return 1 / (1 + std::exp(-x)); }\n"
+              << "    inline " << t << " identity(" << t << " x) { return x; }\n\n"
+              << "    /**\n"
+              << "     * \\brief Run the net on one record.\n"
+              << "     *\n"
+              << "     * \\param x `inputs` elements.\n"
+              << "     * \\param y Receives `outputs` elements"
+              << (softmax ? ", the probability of each class" : "") << ".\n"
+              << "     */\n"
+              << "    inline void run(const " << t << " *x, " << t << " *y) noexcept {\n";
+
+            (forward<Out, Net, Is>(o, opt), ...);
+
+            if (softmax) {
+                o << "        // Softmax.\n"
+                  << "        " << t << " max = y[0];\n"
+                  << "        for (unsigned j = 1; j < outputs; ++j)\n"
+                  << "            max = y[j] > max ? y[j] : max;\n"
+                  << "        " << t << " sum = 0;\n"
+                  << "        for (unsigned j = 0; j < outputs; ++j)\n"
+                  << "            sum += y[j] = std::exp(y[j] - max);\n"
+                  << "        for (unsigned j = 0; j < outputs; ++j)\n"
+                  << "            y[j] /= sum;\n";
+            }
+
+            o << "    }\n\n"
+              << "    /// Run the net on n records, one after the other.\n"
+              << "    inline void run(const " << t << " *x, " << t << " *y, std::size_t n) noexcept {\n"
+              << "        for (std::size_t i = 0; i < n; ++i)\n"
+              << "            run(x + i * inputs, y + i * outputs);\n"
+              << "    }\n"
+              << "}\n";
+        }
+    }
+
+    /**
+     * \brief Write a header with the net's weights and forward pass.
+     *
+     * \tparam Out The kind of output layer the net was trained with, see nn.hh.
+     * \param  net Weights and biases of a fully connected net (e.g. a
+     *             make_net tuple, or checkpoint::mapped::net()).
+     *
+     * \throw std::invalid_argument if a weight or bias is NaN or infinite
+     *        (nothing is written then).
+     */
+    template<typename Out = nn::sigmoid_mse, typename Net>
+    void emit(std::ostream &o, const Net &net, const options &opt = { }) {
+        detail::emit<Out>(o, net, opt, std::make_index_sequence<std::tuple_size<Net>::value / 2> { });
+    }
+}
@@ -0,0 +1,121 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Nets trained by the compiler: the half adder and the 3-way XOR-ish
+// gate of neuralnet-oo, trained with nn::propagate in a constant
+// expression. The weights end up in the binary as constants; all that
+// is left at run time is the forward pass.
+//
+// Training fails the build if a net does not learn its truth table.
+
+#include "common.hh"
+#include "matrix.hh"
+#include "nn.hh"
+#include "rng.hh"
+#include <cstdio>
+#include <cstdlib>
+#include <tuple>
+
+namespace {
+
+    /**
+     * \brief Train a net on one batch (the whole truth table), usable in
+     *        constant expressions.
+     */
+    template<typename Net, typename XT, typename YT>
+    constexpr Net train(const XT &X, const YT &Y, uint64_t seed, uint epochs, double eta) {
+        using T = typename XT::value_type;
+
+        Net net;
+
+        // The same initialization as idx::run.
+        rng::xoshiro256ss init(seed, rng::init_stream);
+        nn::for_each_layer(net, [&](auto &W, auto &b) {
+            W.mip([&](auto) { return rng::uniform<T>(init, -1, 1); });
+            b.mip([](auto) { return T(0); });
+        });
+
+        auto update = [eta](auto, auto &W, const auto &dW) { W += T(eta) * dW; };
+        for (uint i = 0; i < epochs; ++i)
+            std::apply([&](auto&... Ws) { nn::propagate(update, X, Y, Ws...); }, net);
+
+        return net;
+    }
+
+    template<typename Net, typename XT>
+    constexpr auto run(const Net &net, const XT &X) {
+        return std::apply([&](const auto&... Ws) { return nn::forwards(X, Ws...); }, net);
+    }
+
+    /// Whether every output is within `tolerance` of what it should be.
+    template<typename AT, typename YT>
+    constexpr bool learned(const AT &A, const YT &Y, double tolerance = 0.1) {
+        for (size_t i = 0; i < A.size(); ++i)
+            if (A.data()[i] - Y.data()[i] > tolerance || Y.data()[i] - A.data()[i] > tolerance)
+                return false;
+        return true;
+    }
+
+    // Half adder: sum and carry.
+    constexpr Matrix<double,4,2> adder_X { 0,0, 0,1, 1,0, 1,1 };
+    constexpr Matrix<double,4,2> adder_Y { 0,0, 1,0, 1,0, 0,1 };
+
+    using adder_net = decltype(nn::make_net<double,2,2,1,4>());
+    constexpr adder_net adder = train<adder_net>(adder_X, adder_Y, 1, 300, 4.0);
+
+    static_assert(learned(run(adder, adder_X), adder_Y), "The half adder did not learn");
+
+    // 3-way XOR-ish gate: exactly one input set.
+    constexpr Matrix<double,8,3> xor_X { 0,0,0, 0,0,1, 0,1,0, 0,1,1, 1,0,0, 1,0,1, 1,1,0, 1,1,1 };
+    constexpr Matrix<double,8,1> xor_Y { 0,     1,     1,     0,     1,     0,     0,     0     };
+
+    using xor_net = decltype(nn::make_net<double,3,1,2,4>());
+    constexpr xor_net xor_ = train<xor_net>(xor_X, xor_Y, 1, 500, 2.0);
+
+    static_assert(learned(run(xor_, xor_X), xor_Y), "The XOR gate did not learn");
+
+    template<typename Net, uint rows, uint inputs, uint outputs>
+    void print(const char *name, const Net &net,
+               const Matrix<double,rows,inputs> &X, const Matrix<double,rows,outputs> &) {
+        std::printf("\n%s:\n", name);
+        auto A = run(net, X);
+        for (uint r = 1; r <= rows; ++r) {
+            std::printf("[");
+            for (uint c = 1; c <= inputs; ++c)
+                std::printf(" %.0f", X(r, c));
+            std::printf(" ] =>");
+            for (uint c = 1; c <= outputs; ++c)
+                std::printf(" %.3f", A(r, c));
+            std::printf("\n");
+        }
+    }
+}
+
+// constexpr_train [a b]: run the half adder on a and b, or print both
+// truth tables.
+int main(int argc, char **argv) {
+    if (argc == 3) {
+        Matrix<double,1,2> X { std::atof(argv[1]), std::atof(argv[2]) };
+        auto A = run(adder, X);
+        std::printf("sum %.3f carry %.3f\n", A(1,1), A(1,2));
+        return 0;
+    }
+
+    print("Half adder",         adder, adder_X, adder_Y);
+    print("3-way XOR-ish gate", xor_,  xor_X,   xor_Y);
+    return 0;
+}
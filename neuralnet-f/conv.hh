@@ -0,0 +1,506 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief Convolution and pooling layers.
+ *
+ * An image is stored as one row of a Matrix per record, pixel after
+ * pixel (rows of the image first), with the channels of a pixel next
+ * to each other. That is how IDX images are loaded already (with one
+ * channel), and it is what a convolution layer produces, so there is
+ * no separate flatten step: a fully connected layer after a
+ * convolution simply gets the whole image as its inputs.
+ *
+ * A convolution (stride 1, no padding) is computed by copying every
+ * K x K patch of the input into a row of a matrix (im2col), and
+ * multiplying that by the kernels (one column per filter) with the
+ * GEMM kernel, which also adds the bias and applies the activation
+ * function. Max or average pooling follows, if any.
+ *
+ * The weights of a convolution are a Matrix (of patch x filters) that
+ * also carries the shape of the layer in its type, so nets with
+ * convolutions are tuples of weights and biases like any other, and
+ * train, checkpoint and optimize the same way. Shapes are checked at
+ * compile time.
+ */
+
+#include "common.hh"
+#include "matrix.hh"
+#include "nn.hh"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <tuple>
+#include <type_traits>
+
+namespace nn {
+
+    /**
+     * \brief The shape of an image: height x width pixels of C channels.
+     */
+    template<uint H, uint W, uint C = 1>
+    struct image {
+        static constexpr uint height   = H;
+        static constexpr uint width    = W;
+        static constexpr uint channels = C;
+        static constexpr uint size     = H * W * C;
+    };
+
+    /// No pooling.
+    struct no_pool {
+        static constexpr uint size = 1;
+    };
+
+    /// The maximum of each P x P block.
+    template<uint P>
+    struct max_pool {
+        static constexpr uint size = P;
+    };
+
+    /// The average of each P x P block.
+    template<uint P>
+    struct avg_pool {
+        static constexpr uint size = P;
+    };
+
+    /**
+     * \brief A convolution layer of make_conv_net: F filters of K x K
+     *        pixels, followed by pooling.
+     */
+    template<uint K, uint F, typename Pool = no_pool>
+    struct conv { };
+
+    /**
+     * \brief The shape of a convolution layer on images of shape In.
+     */
+    template<typename In, uint K, uint F, typename Pool = no_pool>
+    struct conv_spec {
+        static_assert(K >= 1 && K <= In::height && K <= In::width,
+                      "Convolution kernel is larger than its input");
+        static_assert(F >= 1, "A convolution needs at least one filter");
+
+        using input = In;
+        using pool  = Pool;
+
+        static constexpr uint kernel  = K;
+        static constexpr uint filters = F;
+        /// Inputs of one filter (rows of the weight matrix).
+        static constexpr uint patch   = K * K * In::channels;
+
+        /// The output before pooling.
+        using convolved = image<In::height - K + 1, In::width - K + 1, F>;
+
+        static_assert(convolved::height % Pool::size == 0 && convolved::width % Pool::size == 0,
+                      "Pool size must divide the size of the convolution's output");
+
+        using output = image<convolved::height / Pool::size, convolved::width / Pool::size, F>;
+
+        static constexpr bool pooled = Pool::size > 1;
+    };
+
+    /**
+     * \brief Weights of a convolution layer: one column per filter,
+     *        stored in M (a Matrix, or a MatrixView on a checkpoint).
+     */
+    template<typename Spec, typename M>
+    class conv_weights : public M {
+        static_assert(M::nrows == Spec::patch && M::ncols == Spec::filters,
+                      "Convolution weights must be patch x filters");
+
+    public:
+        using conv_spec = Spec;
+        using base_type = M;
+
+        /// The same layer, stored in M2.
+        template<typename M2>
+        using rebind = conv_weights<Spec, M2>;
+
+        using M::M;
+        using M::operator=;
+
+        conv_weights() = default;
+        conv_weights(const M &m) : M(m) { }
+        conv_weights(M &&m) : M(std::move(m)) { }
+
+        const M &base() const { return *this; }
+    };
+
+    template<typename T, typename Spec>
+    using conv2d = conv_weights<Spec, Matrix<T, Spec::patch, Spec::filters>>;
+
+    /**
+     * \brief What a convolution layer keeps of a batch for backpropagation.
+     */
+    template<typename T, uint B, typename Spec>
+    struct conv_activation {
+        using conv_spec  = Spec;
+        using value_type = T;
+
+        static constexpr uint nrows = B;
+
+        /// Activations before pooling (not kept without pooling).
+        std::conditional_t<Spec::pooled,
+                           Matrix<T, B, Spec::convolved::size>,
+                           Matrix<T, 1, 1>> pre { matrix_detail::uninitialized };
+        /// Activations after pooling, the inputs of the next layer.
+        Matrix<T, B, Spec::output::size> out { matrix_detail::uninitialized };
+        /// im2col of the layer's inputs, reused for the weight delta.
+        Matrix<T, B * Spec::convolved::height * Spec::convolved::width, Spec::patch>
+            cols { matrix_detail::uninitialized };
+    };
+
+    /**
+     * \brief Deltas of a convolution layer's (pre-pooling) activations,
+     *        along with the im2col of its inputs from the forward pass.
+     */
+    template<typename T, uint B, typename Spec>
+    struct conv_delta : Matrix<T, B, Spec::convolved::size> {
+        using Matrix<T, B, Spec::convolved::size>::operator=;
+
+        const T *cols;
+
+        explicit conv_delta(const T *cols)
+            : Matrix<T, B, Spec::convolved::size>(matrix_detail::uninitialized),
+              cols(cols)
+            { }
+    };
+
+    namespace detail {
+
+        /**
+         * \brief Copy every patch of B images into a row of cols.
+         *
+         * One row of a patch (K pixels of all channels) is contiguous in
+         * the image and in the row of cols.
+         */
+        template<typename S, typename T>
+        void im2col(const T *x, uint B, T *cols) {
+            using In = typename S::input;
+            using Out = typename S::convolved;
+            constexpr uint K  = S::kernel;
+            constexpr uint KC = K * In::channels;
+
+            for (uint b = 0; b < B; ++b, x += In::size)
+                for (uint y = 0; y < Out::height; ++y)
+                    for (uint c = 0; c < Out::width; ++c)
+                        for (uint ky = 0; ky < K; ++ky, cols += KC)
+                            std::memcpy(cols, x + (size_t(y + ky) * In::width + c) * In::channels,
+                                        KC * sizeof(T));
+        }
+
+        /// The reverse of im2col: add every row of cols to its patch.
+        template<typename S, typename T>
+        void col2im(const T *cols, uint B, T *x) {
+            using In = typename S::input;
+            using Out = typename S::convolved;
+            constexpr uint K  = S::kernel;
+            constexpr uint KC = K * In::channels;
+
+            std::fill(x, x + size_t(B) * In::size, T(0));
+            for (uint b = 0; b < B; ++b, x += In::size)
+                for (uint y = 0; y < Out::height; ++y)
+                    for (uint c = 0; c < Out::width; ++c)
+                        for (uint ky = 0; ky < K; ++ky, cols += KC) {
+                            T *p = x + (size_t(y + ky) * In::width + c) * In::channels;
+                            for (uint i = 0; i < KC; ++i)
+                                p[i] += cols[i];
+                        }
+        }
+
+        /**
+         * \brief Call f(from, to) for every pixel of every pooling block
+         *        of B images, with `from` its index in the convolved image
+         *        and `to` that of the block in the pooled image. Both
+         *        index the first channel.
+         */
+        template<typename S, typename F>
+        void for_each_pooled(uint B, const F &f) {
+            using In  = typename S::convolved;
+            using Out = typename S::output;
+            constexpr uint P = S::pool::size;
+            constexpr uint C = In::channels;
+
+            for (uint b = 0; b < B; ++b)
+                for (uint y = 0; y < In::height; ++y)
+                    for (uint x = 0; x < In::width; ++x)
+                        f(size_t(b) * In::size  + (size_t(y) * In::width + x) * C,
+                          size_t(b) * Out::size + (size_t(y / P) * Out::width + x / P) * C);
+        }
+
+        template<typename S, typename T>
+        void pool(const T *pre, uint B, T *out) {
+            constexpr uint C = S::filters;
+            constexpr bool max = std::is_same<typename S::pool, max_pool<S::pool::size>>::value;
+
+            std::fill(out, out + size_t(B) * S::output::size,
+                      max ? -std::numeric_limits<T>::infinity() : T(0));
+            for_each_pooled<S>(B, [&](size_t from, size_t to) {
+                for (uint c = 0; c < C; ++c) {
+                    if constexpr (max)
+                        out[to + c] = std::max(out[to + c], pre[from + c]);
+                    else
+                        out[to + c] += pre[from + c] / T(S::pool::size * S::pool::size);
+                }
+            });
+        }
+
+        /**
+         * \brief Deltas of the convolution's (pre-pooling) activations,
+         *        from those of the pooled ones.
+         *
+         * Max pooling passes each delta to the first pixel of its block
+         * that was the maximum, average pooling spreads it evenly.
+         */
+        template<typename S, typename T>
+        void unpool(const T *pre, const T *out, const T *e, uint B, T *d) {
+            constexpr uint C = S::filters;
+            constexpr bool max = std::is_same<typename S::pool, max_pool<S::pool::size>>::value;
+
+            std::fill(d, d + size_t(B) * S::convolved::size, T(0));
+            if constexpr (max) {
+                using In  = typename S::convolved;
+                using Out = typename S::output;
+                constexpr uint P = S::pool::size;
+
+                for (uint b = 0; b < B; ++b) {
+                    for (uint by = 0; by < Out::height; ++by) {
+                        for (uint bx = 0; bx < Out::width; ++bx) {
+                            size_t to = size_t(b) * Out::size + (size_t(by) * Out::width + bx) * C;
+                            // Whether the delta of a channel has been passed on.
+                            bool done[C] = { };
+                            for (uint y = by * P; y < by * P + P; ++y) {
+                                for (uint x = bx * P; x < bx * P + P; ++x) {
+                                    size_t from = size_t(b) * In::size + (size_t(y) * In::width + x) * C;
+                                    for (uint c = 0; c < C; ++c) {
+                                        if (!done[c] && pre[from + c] == out[to + c]) {
+                                            d[from + c] = e[to + c];
+                                            done[c] = true;
+                                        }
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            } else {
+                for_each_pooled<S>(B, [&](size_t from, size_t to) {
+                    for (uint c = 0; c < C; ++c)
+                        d[from + c] = e[to + c] / T(S::pool::size * S::pool::size);
+                });
+            }
+        }
+    }
+
+    /**
+     * \brief A convolution layer, see layer_traits in nn.hh.
+     */
+    template<typename WT>
+    struct layer_traits<WT, std::void_t<typename WT::conv_spec>> {
+        using S = typename WT::conv_spec;
+
+        static constexpr bool dense  = false;
+        static constexpr uint inputs = S::input::size;
+
+        /**
+         * \brief f(im2col(A) W + b), one row per pixel, written to out.
+         *
+         * im2col(A) is written to cols, B*OH*OW rows of S::patch.
+         */
+        template<typename AT, typename BT, typename F>
+        static void convolve(const AT &A, const WT &W, const BT &b, const F &f,
+                             typename AT::value_type *out,
+                             typename AT::value_type *cols) {
+            static_assert(AT::ncols == S::input::size,
+                          "Inputs do not match the convolution's input image");
+            static_assert(BT::nrows == 1 && BT::ncols == S::filters, "Bias dimension mismatch");
+
+            using T = typename AT::value_type;
+            constexpr uint N  = AT::nrows * S::convolved::height * S::convolved::width;
+            constexpr uint NR = gemm::params<T>::NR;
+
+            detail::im2col<S>(A.data(), AT::nrows, cols);
+
+            // The kernel reads whole vectors of biases, see matrix_expr::product::map.
+            alignas(64) T pb[(S::filters + NR - 1) / NR * NR] = { };
+            for (uint j = 0; j < S::filters; ++j)
+                pb[j] = T(b.data()[j]);
+
+            dot(MatrixView<T, N, S::patch>(cols), W.base())
+                .eval_into(out, false, matrix_expr::bias_map<T,F> { pb, f });
+        }
+
+        template<typename AT, typename BT, typename F>
+        static auto forward(const AT &A, const WT &W, const BT &b, const F &f) {
+            using T = typename AT::value_type;
+            constexpr uint B = AT::nrows;
+
+            Matrix<T, B, S::convolved::size> Z(matrix_detail::uninitialized);
+            Matrix<T, B * S::convolved::height * S::convolved::width, S::patch>
+                cols(matrix_detail::uninitialized);
+            convolve(A, W, b, f, Z.data(), cols.data());
+            if constexpr (S::pooled) {
+                Matrix<T, B, S::output::size> P(matrix_detail::uninitialized);
+                detail::pool<S>(Z.data(), B, P.data());
+                return P;
+            } else {
+                return Z;
+            }
+        }
+
+        template<typename AT, typename BT, typename F>
+        static auto train_forward(const AT &A, const WT &W, const BT &b, const F &f) {
+            using T = typename AT::value_type;
+            constexpr uint B = AT::nrows;
+
+            conv_activation<T, B, S> L;
+            if constexpr (S::pooled) {
+                convolve(A, W, b, f, L.pre.data(), L.cols.data());
+                detail::pool<S>(L.pre.data(), B, L.out.data());
+            } else {
+                convolve(A, W, b, f, L.out.data(), L.cols.data());
+            }
+            return L;
+        }
+
+        /**
+         * \brief im2col(A)^T D, with D the deltas of the (pre-pooling)
+         *        outputs.
+         *
+         * im2col(A) was kept from the forward pass, see conv_delta.
+         */
+        template<typename AT, typename T, uint B>
+        static auto weight_delta(const AT &, const conv_delta<T, B, S> &D) {
+            constexpr uint N = B * S::convolved::height * S::convolved::width;
+
+            Matrix<T, S::patch, S::filters> dW(matrix_detail::uninitialized);
+            dW = dot(MatrixView<T, N, S::patch>(D.cols).T(),
+                     MatrixView<T, N, S::filters>(D.data()));
+            return dW;
+        }
+
+        /// col2im(D W^T).
+        template<typename DT>
+        static auto input_delta(const DT &D, const WT &W) {
+            using T = typename DT::value_type;
+            constexpr uint B = DT::nrows;
+            constexpr uint N = B * S::convolved::height * S::convolved::width;
+
+            Matrix<T, N, S::patch> E_cols(matrix_detail::uninitialized);
+            E_cols = dot(MatrixView<T, N, S::filters>(D.data()), W.base().T());
+
+            Matrix<T, B, S::input::size> E(matrix_detail::uninitialized);
+            detail::col2im<S>(E_cols.data(), B, E.data());
+            return E;
+        }
+
+        template<typename T2>
+        static auto cast(const WT &W) {
+            return conv2d<T2, S>(matrix_cast<T2>(W.base()));
+        }
+    };
+
+    /**
+     * \brief Activations of a convolution layer, see activation_traits in nn.hh.
+     */
+    template<typename LT>
+    struct activation_traits<LT, std::void_t<typename LT::conv_spec>> {
+        using S = typename LT::conv_spec;
+        using T = typename LT::value_type;
+        static constexpr uint B = LT::nrows;
+
+        static const auto &matrix(const LT &L) { return L.out; }
+
+        template<typename ET, typename DBT>
+        static auto delta(const LT &L, const ET &E, DBT &dB) {
+            static_assert(DBT::ncols == S::filters, "Bias dimension mismatch");
+
+            // Deltas of the (pre-pooling) activations, times g'.
+            conv_delta<T, B, S> D(L.cols.data());
+            const T *A;
+            if constexpr (S::pooled) {
+                Matrix<T, B, S::output::size> Eo(matrix_detail::uninitialized);
+                Eo = E;
+                detail::unpool<S>(L.pre.data(), L.out.data(), Eo.data(), B, D.data());
+                A = L.pre.data();
+            } else {
+                D = E;
+                A = L.out.data();
+            }
+            simd::transform(D.size(), D.data(),
+                            simd::vectorized([](auto d, auto a) { return d * g_(a); }),
+                            D.data(), A);
+
+            // Every pixel shares the bias of its filter.
+            std::fill(dB.data(), dB.data() + dB.size(), 0);
+            for (size_t i = 0; i < D.size(); i += S::filters)
+                for (uint c = 0; c < S::filters; ++c)
+                    dB.data()[c] += D.data()[i + c];
+            return D;
+        }
+    };
+
+    namespace detail {
+
+        template<typename T, typename In, typename... Cs>
+        struct conv_stack {
+            using type   = std::tuple<>;
+            using output = In;
+        };
+
+        template<typename T, typename In, uint K, uint F, typename Pool, typename... Cs>
+        struct conv_stack<T, In, conv<K,F,Pool>, Cs...> {
+            using spec = conv_spec<In, K, F, Pool>;
+            using rest = conv_stack<T, typename spec::output, Cs...>;
+
+            using type   = decltype(std::tuple_cat(std::declval<std::tuple<conv2d<T,spec>, Matrix<T, 1, F>>>(),
+                                                   std::declval<typename rest::type>()));
+            using output = typename rest::output;
+        };
+
+        template<typename T, typename In, typename Convs, uint O, uint H, uint N>
+        struct make_conv_net;
+
+        template<typename T, typename In, typename... Cs, uint O, uint H, uint N>
+        struct make_conv_net<T, In, list<Cs...>, O, H, N> {
+            using convs = conv_stack<T, In, Cs...>;
+            using type  = decltype(std::tuple_cat(std::declval<typename convs::type>(),
+                                                  std::declval<nn::make_net<T, convs::output::size, O, H, N>>()));
+        };
+    }
+
+    /**
+     * \brief The type of a net of convolution layers followed by fully
+     *        connected ones.
+     *
+     * \tparam In    The shape of the input images, see image.
+     * \tparam Convs A list of conv layers, input side first.
+     *
+     * The other parameters are those of make_net.
+     */
+    template<typename T,
+             typename In,
+             typename Convs,
+             uint Outputs,
+             uint HiddenLayers,
+             uint NeuronsPerLayer>
+    using make_conv_net = typename detail::make_conv_net<T, In, Convs,
+                                                         Outputs,
+                                                         HiddenLayers,
+                                                         NeuronsPerLayer>::type;
+}
@@ -0,0 +1,403 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief Nets shaped at run time.
+ *
+ * The nets of nn.hh carry their shape in their type, so trying another
+ * amount of layers or neurons means compiling again. A dyn::net gets
+ * its shape from a dyn::shape instead. It runs on the same GEMM kernel
+ * (with the same fused bias and activation), the same vectorized
+ * activation functions and the same output layers as a static net, so
+ * it learns the same things; only loop bounds are no longer constants.
+ *
+ * dispatch() hands shapes that have been compiled in to code for a
+ * static net, and all others to code for a dynamic one.
+ */
+
+#include "common.hh"
+#include "matrix.hh"
+#include "gemm.hh"
+#include "nn.hh"
+#include "simd.hh"
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace dyn {
+
+    /**
+     * \brief A row-major matrix with dimensions decided at run time.
+     *
+     * Elements are 64-byte aligned, and padded with zeroes up to a
+     * multiple of the GEMM kernel's NR, so that a one-row matrix can be
+     * handed to the kernel as a bias (see matrix_expr::bias_map).
+     *
+     * Storage only grows: resizing to something smaller keeps it, so a
+     * matrix reused for every batch allocates once.
+     */
+    template<typename T>
+    class matrix {
+        static constexpr std::align_val_t alignment { 64 };
+        static constexpr uint pad = gemm::params<T>::NR;
+
+        struct deleter {
+            void operator()(T *p) const { ::operator delete(p, alignment); }
+        };
+
+        std::unique_ptr<T,deleter> elems;
+        size_t cap   = 0;
+        uint   nrows = 0;
+        uint   ncols = 0;
+
+    public:
+        using value_type = T;
+
+        matrix() = default;
+        matrix(uint rows, uint cols) { resize(rows, cols); }
+
+        matrix(matrix&&) = default;
+        matrix &operator=(matrix&&) = default;
+
+        matrix(const matrix &o)
+            : matrix(o.nrows, o.ncols)
+            { std::copy(o.data(), o.data() + o.size(), data()); }
+
+        matrix &operator=(const matrix &o) {
+            if (this != &o) {
+                resize(o.nrows, o.ncols);
+                std::copy(o.data(), o.data() + o.size(), data());
+            }
+            return *this;
+        }
+
+        /**
+         * \brief Change the dimensions.
+         *
+         * Elements are zero if the storage had to grow, and left as they
+         * were otherwise (apart from the padding, which is always zero).
+         */
+        void resize(uint rows, uint cols) {
+            size_t n = (size_t(rows) * cols + pad - 1) / pad * pad;
+            if (n > cap) {
+                elems.reset(static_cast<T*>(::operator new(n * sizeof(T), alignment)));
+                cap = n;
+                std::fill(elems.get(), elems.get() + cap, T(0));
+            }
+            nrows = rows;
+            ncols = cols;
+            std::fill(elems.get() + size(), elems.get() + cap, T(0));
+        }
+
+        uint   rows() const { return nrows; }
+        uint   cols() const { return ncols; }
+        size_t size() const { return size_t(nrows) * ncols; }
+
+        const T *data() const { return elems.get(); }
+              T *data()       { return elems.get(); }
+
+        /// 1-based, like Matrix.
+        const T &operator()(uint row, uint col) const { return data()[size_t(row-1) * ncols + col-1]; }
+              T &operator()(uint row, uint col)       { return data()[size_t(row-1) * ncols + col-1]; }
+
+        gemm::operand<T> operand()    const { return { data(), ncols, 1 }; }
+        gemm::operand<T> transposed() const { return { data(), 1, ncols }; }
+    };
+
+    /**
+     * \brief The shape of a net, like the template arguments of nn::make_net.
+     */
+    struct shape {
+        uint inputs;
+        uint outputs;
+        uint hidden_layers;
+        uint neurons_per_layer;
+    };
+
+    /**
+     * \brief A net: a weight matrix and a bias row per layer.
+     */
+    template<typename T>
+    class net {
+        std::vector<matrix<T>> w;
+        std::vector<matrix<T>> b;
+
+    public:
+        using value_type = T;
+
+        /// All weights and biases start at zero.
+        explicit net(const shape &s) {
+            uint from = s.inputs;
+            for (uint i = 0; i <= s.hidden_layers; ++i) {
+                uint to = i < s.hidden_layers ? s.neurons_per_layer : s.outputs;
+                w.emplace_back(from, to);
+                b.emplace_back(1, to);
+                from = to;
+            }
+        }
+
+        uint layers()  const { return w.size(); }
+        uint inputs()  const { return w.front().rows(); }
+        uint outputs() const { return w.back().cols(); }
+
+        const matrix<T> &weights(uint i) const { return w[i]; }
+              matrix<T> &weights(uint i)       { return w[i]; }
+        const matrix<T> &bias(uint i)    const { return b[i]; }
+              matrix<T> &bias(uint i)          { return b[i]; }
+    };
+
+    /**
+     * \brief Call f(W, b) with the weights and biases of every layer,
+     *        input layer first (like nn::for_each_layer).
+     */
+    template<typename T, typename F>
+    void for_each_layer(net<T> &n, F f) {
+        for (uint i = 0; i < n.layers(); ++i)
+            f(n.weights(i), n.bias(i));
+    }
+
+    namespace detail {
+
+        /**
+         * \brief c = alpha * a * b, or c += alpha * a * b if `accumulate`
+         *        is set (like matrix_expr::product::eval_into).
+         *
+         * a is m x k, b is k x n, c is m x n and dense.
+         */
+        template<typename T, typename E = gemm::no_epilogue>
+        void multiply(uint m, uint n, uint k, T alpha,
+                      gemm::operand<T> a, gemm::operand<T> b,
+                      T *c, bool accumulate, const E &epilogue = { }) {
+            if (gemm::worth_it<T>(m, n, k)) {
+                gemm::gemm<T>(m, n, k, alpha, a, b, c, n, accumulate, epilogue);
+            } else {
+                for (uint i = 0; i < m; ++i) {
+                    for (uint j = 0; j < n; ++j) {
+                        T sum = 0;
+                        for (uint l = 0; l < k; ++l)
+                            sum += a(i, l) * b(l, j);
+                        auto &x = c[size_t(i) * n + j];
+                        x = epilogue((accumulate ? x : 0) + alpha * sum, j);
+                    }
+                }
+            }
+        }
+
+        /// Sum the rows of d into sums.
+        template<typename T>
+        void colsum(const matrix<T> &d, matrix<T> &sums) {
+            sums.resize(1, d.cols());
+            std::fill(sums.data(), sums.data() + sums.size(), T(0));
+            for (uint r = 0; r < d.rows(); ++r)
+                simd::transform(d.cols(), sums.data(), simd::vectorized([](auto s, auto x) { return s + x; }),
+                                sums.data(), d.data() + size_t(r) * d.cols());
+        }
+    }
+
+    /**
+     * \brief A lazy product, see nn::propagate: weight deltas are passed
+     *        to updaters as one of these.
+     */
+    template<typename T>
+    struct product {
+        gemm::operand<T> a;
+        gemm::operand<T> b;
+        uint m, n, k;
+
+        uint rows() const { return m; }
+        uint cols() const { return n; }
+
+        /// c += alpha * product, in one pass of the GEMM kernel.
+        void add_to(T *c, T alpha) const { detail::multiply(m, n, k, alpha, a, b, c, true); }
+
+        void eval_into(T *c) const { detail::multiply(m, n, k, T(1), a, b, c, false); }
+    };
+
+    /**
+     * \brief Activations and deltas for one batch.
+     *
+     * Keep one around between batches so that training does not
+     * allocate.
+     */
+    template<typename T>
+    struct workspace {
+        std::vector<matrix<T>> A; ///< Activations per layer.
+        matrix<T> D,  dB;         ///< Deltas of the current layer and their sum.
+        matrix<T> D1, dB1;        ///< The same, for the layer below it.
+    };
+
+    /**
+     * \brief A = f(X W + b), computed by the GEMM kernel with the bias and
+     *        f applied in its epilogue (like nn::forward_one).
+     */
+    template<typename T, typename F>
+    void forward_one(gemm::operand<T> X, uint rows,
+                     const matrix<T> &W, const matrix<T> &b,
+                     matrix<T> &A, const F &f) {
+        A.resize(rows, W.cols());
+        detail::multiply(rows, W.cols(), W.rows(), T(1), X, W.operand(),
+                         A.data(), false, matrix_expr::bias_map<T,F> { b.data(), f });
+    }
+
+    /**
+     * \brief Forward propagate a batch of `rows` records (X is rows x inputs).
+     *
+     * \tparam Out The kind of output layer, see nn.hh.
+     *
+     * \return The activations of the output layer, kept in ws.
+     */
+    template<typename Out = nn::sigmoid_mse, typename T>
+    const matrix<T> &forwards(const T *X, uint rows, const net<T> &n, workspace<T> &ws) {
+        ws.A.resize(n.layers());
+        uint last = n.layers() - 1;
+        for (uint i = 0; i < n.layers(); ++i) {
+            gemm::operand<T> in = i ? ws.A[i-1].operand()
+                                    : gemm::operand<T> { X, n.inputs(), 1 };
+            if (i < last)
+                forward_one(in, rows, n.weights(i), n.bias(i), ws.A[i], nn::g);
+            else
+                forward_one(in, rows, n.weights(i), n.bias(i), ws.A[i], Out::activation);
+        }
+        Out::normalize(ws.A[last].data(), rows, n.outputs());
+        return ws.A[last];
+    }
+
+    /**
+     * \brief Forward and backward propagate a batch, like nn::propagate.
+     *
+     * The updater is called as u(i, W, dW) for every weight matrix (with
+     * dW a dyn::product) and every bias row (with dW a matrix), where i
+     * is the position it would have in a static net's tuple. All deltas
+     * are computed from the weights as they were before the call.
+     *
+     * \param X    rows x inputs.
+     * \param Y    rows x outputs, the expected outputs.
+     */
+    template<typename Out = nn::sigmoid_mse, typename U, typename T>
+    void propagate(U &&u, const T *X, const T *Y, uint rows, net<T> &n, workspace<T> &ws) {
+        forwards<Out>(X, rows, n, ws);
+
+        const matrix<T> &LA = ws.A.back();
+        ws.D.resize(rows, LA.cols());
+        simd::transform(LA.size(), ws.D.data(), Out::delta_one, LA.data(), Y);
+        detail::colsum(ws.D, ws.dB);
+
+        for (uint i = n.layers(); i-- > 0; ) {
+            matrix<T> &W = n.weights(i);
+            gemm::operand<T> in = i ? ws.A[i-1].transposed()
+                                    : gemm::operand<T> { X, 1, n.inputs() };
+            product<T> dW { in, ws.D.operand(), W.rows(), W.cols(), rows };
+
+            if (i > 0) {
+                // Our own delta, from the weights before the update below.
+                const matrix<T> &L1 = ws.A[i-1];
+                ws.D1.resize(rows, W.rows());
+                detail::multiply(rows, W.rows(), W.cols(), T(1), ws.D.operand(), W.transposed(),
+                                 ws.D1.data(), false);
+                simd::transform(ws.D1.size(), ws.D1.data(),
+                                simd::vectorized([](auto d, auto a) { return d * nn::g_(a); }),
+                                ws.D1.data(), L1.data());
+                detail::colsum(ws.D1, ws.dB1);
+            }
+
+            u(2*i,     W,           dW);
+            u(2*i + 1, n.bias(i), ws.dB);
+
+            std::swap(ws.D,  ws.D1);
+            std::swap(ws.dB, ws.dB1);
+        }
+    }
+
+    /**
+     * \brief Plain gradient descent, like nn::train.
+     */
+    template<typename T>
+    struct sgd {
+        T eta = nn::eta;
+
+        void operator()(uint, matrix<T> &W, const product<T> &dW) const {
+            dW.add_to(W.data(), eta);
+        }
+
+        void operator()(uint, matrix<T> &b, const matrix<T> &dB) const {
+            T e = eta;
+            simd::transform(b.size(), b.data(), simd::vectorized([e](auto x, auto d) { return x + e * d; }),
+                            b.data(), dB.data());
+        }
+    };
+
+    /**
+     * \brief Train the net on one batch, using gradient descent.
+     */
+    template<typename Out = nn::sigmoid_mse, typename T>
+    void train(const T *X, const T *Y, uint rows, net<T> &n, workspace<T> &ws, T eta = nn::eta) {
+        propagate<Out>(sgd<T> { eta }, X, Y, rows, n, ws);
+    }
+
+    /**
+     * \brief A shape that is compiled in, see dispatch().
+     */
+    template<uint Inputs, uint Outputs, uint HiddenLayers, uint NeuronsPerLayer>
+    struct static_shape {
+        static constexpr uint inputs            = Inputs;
+        static constexpr uint outputs           = Outputs;
+        static constexpr uint hidden_layers     = HiddenLayers;
+        static constexpr uint neurons_per_layer = NeuronsPerLayer;
+
+        /// The static net of this shape.
+        template<typename T>
+        using net = nn::make_net<T, Inputs, Outputs, HiddenLayers, NeuronsPerLayer>;
+
+        static constexpr bool matches(const shape &s) {
+            return s.inputs == Inputs && s.outputs == Outputs
+                && s.hidden_layers == HiddenLayers && s.neurons_per_layer == NeuronsPerLayer;
+        }
+    };
+
+    namespace detail {
+
+        template<typename S1, typename... Ss, typename FS, typename FD>
+        auto dispatch(const shape &s, FS &on_static, FD &on_dynamic) {
+            if (S1::matches(s))
+                return on_static(S1 { });
+            if constexpr (sizeof...(Ss) > 0)
+                return dispatch<Ss...>(s, on_static, on_dynamic);
+            else
+                return on_dynamic(s);
+        }
+    }
+
+    /**
+     * \brief Run code specialized for shape s if there is any.
+     *
+     * Calls on_static(S { }) for the first static_shape S in Static...
+     * that matches s, or on_dynamic(s) if none does. Both must return
+     * the same type.
+     */
+    template<typename... Static, typename FS, typename FD>
+    auto dispatch(const shape &s, FS &&on_static, FD &&on_dynamic) {
+        if constexpr (sizeof...(Static) == 0) {
+            return on_dynamic(s);
+        } else {
+            return detail::dispatch<Static...>(s, on_static, on_dynamic);
+        }
+    }
+}
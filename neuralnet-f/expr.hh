@@ -0,0 +1,490 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief Lazy matrix expressions.
+ *
+ * Element-wise operations (+, -, *, map) on matrices build a `node`
+ * instead of a result matrix. A node is evaluated in a single pass over
+ * memory when it is assigned to (or used to construct) a Matrix.
+ *
+ * Matrix products build a `product`, which is computed by the GEMM
+ * kernel straight into its destination. `x += a * dot(b, c)` accumulates
+ * into x without a temporary.
+ *
+ * Transposition builds a `transposed` view, which the GEMM kernel can
+ * read directly.
+ *
+ * A MatrixView (elements owned by someone else, e.g. a memory-mapped
+ * file) is a leaf by itself, and is captured by value.
+ *
+ * Operands are captured by reference when they are lvalue matrices and
+ * by value otherwise, so an expression stored in an `auto` variable
+ * stays valid for as long as the named matrices it refers to.
+ */
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "gemm.hh"
+#include "half.hh"
+#include "simd.hh"
+
+template<typename T1, uint rows, uint cols>
+class Matrix;
+
+template<typename T1, uint rows, uint cols>
+class MatrixView;
+
+namespace matrix_detail {
+    /// Tag for constructing a Matrix whose elements are about to be overwritten.
+    struct uninitialized_t { };
+    constexpr uninitialized_t uninitialized { };
+}
+
+namespace matrix_expr {
+
+    template<typename T>
+    struct is_matrix : std::false_type { };
+    template<typename T1, uint rows, uint cols>
+    struct is_matrix<Matrix<T1,rows,cols>> : std::true_type { };
+
+    template<typename V, typename T>
+    constexpr V load(const T *p, size_t i) {
+        if constexpr (std::is_arithmetic<V>::value)
+            return p[i];
+        else
+            return simd::load<V>(p + i);
+    }
+
+    // Leaves. {{{
+
+    /**
+     * \brief A matrix owned by someone else.
+     */
+    template<typename M>
+    struct ref {
+        using matrix_type = M;
+        using value_type  = typename M::value_type;
+        static constexpr uint nrows = M::nrows;
+        static constexpr uint ncols = M::ncols;
+        static constexpr bool vectorized = true;
+
+        const M *m;
+
+        constexpr const M &get() const { return *m; }
+        constexpr const value_type *data() const { return m->data(); }
+
+        constexpr gemm::operand<value_type> operand() const { return { data(), ncols, 1 }; }
+
+        template<typename V>
+        constexpr V packet(size_t i) const { return load<V>(data(), i); }
+    };
+
+    /**
+     * \brief A (temporary) matrix owned by the expression.
+     */
+    template<typename M>
+    struct own {
+        using matrix_type = M;
+        using value_type  = typename M::value_type;
+        static constexpr uint nrows = M::nrows;
+        static constexpr uint ncols = M::ncols;
+        static constexpr bool vectorized = true;
+
+        M m;
+
+        constexpr const M &get() const { return m; }
+        constexpr const value_type *data() const { return m.data(); }
+
+        constexpr gemm::operand<value_type> operand() const { return { data(), ncols, 1 }; }
+
+        template<typename V>
+        constexpr V packet(size_t i) const { return load<V>(data(), i); }
+    };
+
+    template<typename T>
+    struct is_own : std::false_type { };
+    template<typename M>
+    struct is_own<own<M>> : std::true_type { };
+
+    template<typename T>
+    struct is_view : std::false_type { };
+    template<typename T1, uint rows, uint cols>
+    struct is_view<MatrixView<T1,rows,cols>> : std::true_type { };
+
+    // }}}
+
+    /**
+     * \brief Evaluate an element-wise expression into `out`.
+     *
+     * `out` may be the storage of one of the leaves of the expression.
+     */
+    template<typename E, typename T>
+    constexpr void evaluate(const E &e, T *out) {
+        constexpr size_t n = size_t(E::nrows) * E::ncols;
+        constexpr size_t w = simd::width<T>;
+        constexpr size_t m = simd::supported<T> && E::vectorized ? n / w * w : 0;
+
+        size_t i = 0;
+        if constexpr (m > 0) {
+            using V = simd::vec<T>;
+            if (!simd::constant_evaluated())
+                for (; i < m; i += w)
+                    simd::store(out + i, e.template packet<V>(i));
+        }
+        for (; i < n; ++i)
+            out[i] = e.template packet<T>(i);
+    }
+
+    /**
+     * \brief Evaluate an element-wise expression into `out`, and add the
+     *        sum of each of its columns to `sums` in the same pass.
+     */
+    template<typename E, typename T>
+    constexpr void evaluate_colsum(const E &e, T *out, T *sums) {
+        constexpr size_t n = E::ncols;
+        constexpr size_t w = simd::width<T>;
+        constexpr size_t m = simd::supported<T> && E::vectorized ? n / w * w : 0;
+
+        for (size_t r = 0; r < E::nrows; ++r, out += n) {
+            size_t i = 0;
+            if constexpr (m > 0) {
+                using V = simd::vec<T>;
+                if (!simd::constant_evaluated()) {
+                    for (; i < m; i += w) {
+                        V x = e.template packet<V>(r * n + i);
+                        simd::store(out + i, x);
+                        simd::store(sums + i, simd::load<V>(sums + i) + x);
+                    }
+                }
+            }
+            for (; i < n; ++i) {
+                out[i]   = e.template packet<T>(r * n + i);
+                sums[i] += out[i];
+            }
+        }
+    }
+
+    /**
+     * \brief A lazy element-wise operation: f(args...).
+     */
+    template<typename F, typename A1, typename... As>
+    class node {
+    public:
+        using matrix_type = typename A1::matrix_type;
+        using value_type  = typename matrix_type::value_type;
+        static constexpr uint nrows = matrix_type::nrows;
+        static constexpr uint ncols = matrix_type::ncols;
+        static constexpr bool vectorized = simd::is_vectorized<F>::value
+                                           && A1::vectorized
+                                           && (As::vectorized && ...);
+
+        static_assert((std::is_same<matrix_type, typename As::matrix_type>::value && ...),
+                      "Element-wise operands must have the same dimensions");
+
+    private:
+        F f;
+        std::tuple<A1, As...> args;
+
+    public:
+        constexpr node(F f, A1 a1, As... as)
+            : f(f),
+              args(std::move(a1), std::move(as)...)
+            { }
+
+        template<typename V>
+        constexpr V packet(size_t i) const {
+            return std::apply([&](const auto &...a) {
+                                  return f(a.template packet<V>(i)...);
+                              }, args);
+        }
+
+        constexpr value_type operator()(uint row, uint col) const {
+            return packet<value_type>(size_t(row-1) * ncols + (col-1));
+        }
+
+        constexpr matrix_type eval() const & {
+            matrix_type m(matrix_detail::uninitialized);
+            evaluate(*this, m.data());
+            return m;
+        }
+
+        constexpr matrix_type eval() && {
+            // Reuse the storage of a temporary operand, if we have one.
+            if constexpr (is_own<A1>::value) {
+                auto &m = std::get<0>(args).m;
+                evaluate(*this, m.data());
+                return std::move(m);
+            } else {
+                return eval();
+            }
+        }
+
+        template<typename G>
+        constexpr auto map(const G &g) const & { return node<G,node>(g, *this); }
+        template<typename G>
+        constexpr auto map(const G &g) &&      { return node<G,node>(g, std::move(*this)); }
+    };
+
+    /**
+     * \brief A transposed view on a matrix.
+     */
+    template<typename L>
+    class transposed {
+        L l;
+
+    public:
+        using value_type  = typename L::value_type;
+        static constexpr uint nrows = L::ncols;
+        static constexpr uint ncols = L::nrows;
+        using matrix_type = Matrix<value_type, nrows, ncols>;
+
+        constexpr explicit transposed(L l) : l(std::move(l)) { }
+
+        constexpr const value_type *data() const { return l.data(); }
+
+        constexpr bool aliases(const value_type *p) const { return data() == p; }
+
+        constexpr gemm::operand<value_type> operand() const { return { data(), 1, L::ncols }; }
+
+        constexpr value_type operator()(uint row, uint col) const { return l.get()(col, row); }
+
+        constexpr matrix_type eval() const {
+            matrix_type m(matrix_detail::uninitialized);
+            for (uint r = 0; r < L::nrows; ++r)
+                for (uint c = 0; c < L::ncols; ++c)
+                    m.data()[size_t(c) * ncols + r] = data()[size_t(r) * L::ncols + c];
+            return m;
+        }
+    };
+
+    /**
+     * \brief GEMM epilogue: add a bias row to every row, then apply f.
+     */
+    template<typename T, typename F>
+    struct bias_map {
+        const T *bias;
+        F        f;
+
+        template<typename V>
+        constexpr V operator()(V x, size_t col) const {
+            if constexpr (std::is_arithmetic<V>::value) {
+                return f(x + bias[col]);
+            } else {
+                V y = x + simd::load<V>(bias + col);
+                if constexpr (simd::is_vectorized<F>::value) {
+                    return f(y);
+                } else {
+                    for (size_t i = 0; i < sizeof(V) / sizeof(T); ++i)
+                        y[i] = f(y[i]);
+                    return y;
+                }
+            }
+        }
+    };
+
+    /**
+     * \brief A lazy matrix product: alpha * a * b.
+     */
+    template<typename A, typename B>
+    class product {
+    public:
+        // A 16-bit operand is widened to the type of the other one.
+        using value_type  = std::conditional_t<half::is_half<typename A::value_type>::value,
+                                               typename B::value_type,
+                                               typename A::value_type>;
+        static constexpr uint nrows = A::nrows;
+        static constexpr uint ncols = B::ncols;
+        using matrix_type = Matrix<value_type, nrows, ncols>;
+
+        static_assert(A::ncols == B::nrows, "Matrix product dimension mismatch");
+        static_assert(!half::is_half<value_type>::value,
+                      "16-bit matrices can only be multiplied with wider ones");
+        static_assert(std::is_same<typename B::value_type, value_type>::value
+                      || half::is_half<typename B::value_type>::value,
+                      "Matrix product element type mismatch");
+
+    private:
+        A a;
+        B b;
+        value_type alpha = 1;
+
+    public:
+        constexpr product(A a, B b)
+            : a(std::move(a)),
+              b(std::move(b))
+            { }
+
+        /// Whether p is the storage of one of the operands.
+        constexpr bool aliases(const value_type *p) const { return a.data() == p || b.data() == p; }
+
+        /**
+         * \brief Compute the product into c (or add it to c, if `accumulate` is set).
+         *
+         * Large products go through the blocked kernel in gemm.hh; which
+         * path is taken is decided at compile time from the dimensions
+         * (and in constant expressions, it is always the simple loop).
+         * The epilogue is applied to each final element, see gemm::no_epilogue.
+         */
+        template<typename E = gemm::no_epilogue>
+        constexpr void eval_into(value_type *c, bool accumulate, const E &epilogue = { }) const {
+            constexpr uint K = A::ncols;
+            auto oa = a.operand();
+            auto ob = b.operand();
+
+            if constexpr (std::is_floating_point<value_type>::value
+                          && gemm::worth_it<value_type>(nrows, ncols, K)) {
+                if (!simd::constant_evaluated()) {
+                    gemm::gemm<value_type>(nrows, ncols, K, alpha, oa, ob, c, ncols, accumulate, epilogue);
+                    return;
+                }
+            }
+            for (uint i = 0; i < nrows; ++i) {
+                for (uint j = 0; j < ncols; ++j) {
+                    value_type sum = 0;
+                    for (uint k = 0; k < K; ++k)
+                        sum += value_type(oa(i, k)) * value_type(ob(k, j));
+                    auto &x = c[size_t(i) * ncols + j];
+                    x = epilogue((accumulate ? x : 0) + alpha * sum, j);
+                }
+            }
+        }
+
+        constexpr matrix_type eval() const {
+            matrix_type m(matrix_detail::uninitialized);
+            eval_into(m.data(), false);
+            return m;
+        }
+
+        /**
+         * \brief Compute the product, then apply f to it in place.
+         */
+        template<typename F>
+        constexpr matrix_type map(const F &f) const {
+            matrix_type m = eval();
+            m.mip(f);
+            return m;
+        }
+
+        /**
+         * \brief Compute f(product + bias), with bias added to every row.
+         *
+         * The bias and f are applied by the GEMM kernel while the result
+         * is still in registers (or in the case of tiles at the edge, in
+         * L1).
+         */
+        template<typename F, typename BT>
+        constexpr matrix_type map(const F &f, const BT &bias) const {
+            static_assert(BT::nrows == 1 && BT::ncols == ncols, "Bias dimension mismatch");
+
+            // The kernel reads whole vectors of biases, also past the
+            // last column; give it a padded (and widened) copy.
+            constexpr uint NR = gemm::params<value_type>::NR;
+            alignas(64) value_type b[(ncols + NR - 1) / NR * NR] = { };
+            for (uint j = 0; j < ncols; ++j)
+                b[j] = value_type(bias.data()[j]);
+
+            matrix_type m(matrix_detail::uninitialized);
+            eval_into(m.data(), false, bias_map<value_type,F> { b, f });
+            return m;
+        }
+
+        constexpr product scaled(value_type s) const {
+            product p = *this;
+            p.alpha *= s;
+            return p;
+        }
+    };
+
+    template<typename T>
+    struct is_node : std::false_type { };
+    template<typename... Xs>
+    struct is_node<node<Xs...>> : std::true_type { };
+
+    template<typename T>
+    struct is_transposed : std::false_type { };
+    template<typename L>
+    struct is_transposed<transposed<L>> : std::true_type { };
+
+    template<typename T>
+    struct is_product : std::false_type { };
+    template<typename A, typename B>
+    struct is_product<product<A,B>> : std::true_type { };
+
+    /// Lazy expressions, which can be turned into a Matrix.
+    template<typename T>
+    constexpr bool is_expr = is_node<T>::value
+                          || is_transposed<T>::value
+                          || is_product<T>::value
+                          || is_view<T>::value;
+
+    /// Anything that can take part in a matrix expression.
+    template<typename T>
+    constexpr bool is_operand = is_matrix<T>::value || is_expr<T>;
+
+    /**
+     * \brief Capture an operand of an element-wise operation.
+     */
+    template<typename X>
+    constexpr auto capture(X &&x) {
+        using D = std::decay_t<X>;
+        if constexpr (is_matrix<D>::value) {
+            if constexpr (std::is_lvalue_reference<X>::value)
+                return ref<D> { &x };
+            else
+                return own<D> { std::move(x) };
+        } else if constexpr (is_node<D>::value || is_view<D>::value) {
+            return D(std::forward<X>(x));
+        } else {
+            // Products and transposed views need to be materialized first.
+            return own<typename D::matrix_type> { x.eval() };
+        }
+    }
+
+    /**
+     * \brief Capture an operand of a matrix product.
+     */
+    template<typename X>
+    constexpr auto capture_factor(X &&x) {
+        using D = std::decay_t<X>;
+        if constexpr (is_transposed<D>::value || is_view<D>::value)
+            return D(std::forward<X>(x));
+        else if constexpr (is_matrix<D>::value)
+            return capture(std::forward<X>(x));
+        else
+            return own<typename D::matrix_type> { std::forward<X>(x).eval() };
+    }
+
+    template<typename F, typename... Xs>
+    constexpr auto make_node(F f, Xs&&... xs) {
+        return node<F, decltype(capture(std::forward<Xs>(xs)))...>
+            (f, capture(std::forward<Xs>(xs))...);
+    }
+
+    template<typename X, typename Y>
+    constexpr auto make_product(X &&x, Y &&y) {
+        return product<decltype(capture_factor(std::forward<X>(x))),
+                       decltype(capture_factor(std::forward<Y>(y)))>
+            (capture_factor(std::forward<X>(x)),
+             capture_factor(std::forward<Y>(y)));
+    }
+}
@@ -0,0 +1,327 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief Blocked, packed matrix multiplication kernel.
+ *
+ * This is the classic Goto/BLIS loop nest:
+ *
+ *     for jc in N step NC        (B panel sized for L3)
+ *       for pc in K step KC      (pack KC x NC block of B)
+ *         for ic in M step MC    (pack MC x KC block of A, sized for L2)
+ *           for jr in NC step NR
+ *             for ir in MC step MR
+ *               micro-kernel     (MR x NR tile of C in registers)
+ *
+ * Operands are described by a base pointer and a row and column stride,
+ * so that transposed operands can be packed without being copied first.
+ *
+ * Operands may be stored in a narrower type than the one computed in
+ * (e.g. half::bf16 weights in a float product); they are widened while
+ * packing.
+ *
+ * An epilogue can be applied to each tile of C as it leaves the
+ * registers for the last time, e.g. to add a bias and apply an
+ * activation function without another pass over C.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <algorithm>
+
+#include "simd.hh"
+
+namespace gemm {
+
+    /// Width of a SIMD register in bytes, for sizing register tiles.
+    constexpr size_t vector_bytes = simd::bytes;
+
+    /**
+     * \brief Blocking parameters for element type T.
+     *
+     * A micro-tile is MR rows by two vector registers worth of columns.
+     * KC x NR panels of B stay in L1, MC x KC blocks of A stay in L2.
+     */
+    template<typename T>
+    struct params {
+        static constexpr uint MR = 6;
+        static constexpr uint NR = 2 * vector_bytes / sizeof(T);
+        static constexpr uint KC = 256;
+        static constexpr uint MC = MR * 16;
+        static constexpr uint NC = NR * 128;
+    };
+
+    /**
+     * \brief A read-only view on a row-major (or strided) matrix operand.
+     */
+    template<typename T>
+    struct operand {
+        const T *p;
+        size_t   rs; ///< Row stride.
+        size_t   cs; ///< Column stride.
+
+        constexpr const T &operator()(size_t r, size_t c) const { return p[r*rs + c*cs]; }
+    };
+
+    /**
+     * \brief The default epilogue: leaves the product as it is.
+     *
+     * An epilogue is called as `e(x, col)`, with x either a vector of
+     * consecutive elements of one row of C starting at column `col`, or
+     * a single element. At the right edge of C, vectors extend past the
+     * last column (up to a multiple of NR); those lanes are discarded,
+     * but anything the epilogue reads for them must be readable.
+     */
+    struct no_epilogue {
+        template<typename V>
+        constexpr V operator()(V x, size_t) const { return x; }
+    };
+
+    namespace detail {
+
+        /**
+         * \brief A grow-only, 64-byte aligned scratch buffer.
+         *
+         * Each thread gets its own packing buffers, so they are allocated
+         * once and then reused for every following multiplication.
+         */
+        template<typename T>
+        class scratch {
+            struct deleter {
+                void operator()(T *p) const { ::operator delete(p, std::align_val_t(64)); }
+            };
+            std::unique_ptr<T,deleter> buf;
+            size_t cap = 0;
+
+        public:
+            T *get(size_t n) {
+                if (n > cap) {
+                    buf.reset(static_cast<T*>(::operator new(n * sizeof(T),
+                                                             std::align_val_t(64))));
+                    cap = n;
+                }
+                return buf.get();
+            }
+        };
+
+        /**
+         * \brief Pack an mc x kc block of A into MR-row slivers.
+         *
+         * Within a sliver, the MR elements of one column are contiguous.
+         * Slivers at the bottom edge are padded with zeroes.
+         */
+        template<typename T, typename S>
+        void pack_a(uint mc, uint kc, operand<S> a, T *dst) {
+            constexpr uint MR = params<T>::MR;
+            for (uint i = 0; i < mc; i += MR) {
+                uint mr = std::min(MR, mc - i);
+                for (uint p = 0; p < kc; ++p) {
+                    for (uint ii = 0; ii < mr; ++ii)
+                        dst[ii] = T(a(i + ii, p));
+                    for (uint ii = mr; ii < MR; ++ii)
+                        dst[ii] = 0;
+                    dst += MR;
+                }
+            }
+        }
+
+        /**
+         * \brief Pack a kc x nc block of B into NR-column slivers.
+         *
+         * Within a sliver, the NR elements of one row are contiguous.
+         * Slivers at the right edge are padded with zeroes.
+         */
+        template<typename T, typename S>
+        void pack_b(uint kc, uint nc, operand<S> b, T *dst) {
+            constexpr uint NR = params<T>::NR;
+            for (uint j = 0; j < nc; j += NR) {
+                uint nr = std::min(NR, nc - j);
+                for (uint p = 0; p < kc; ++p) {
+                    if (nr == NR && b.cs == 1) {
+                        const S *src = &b(p, j);
+                        for (uint jj = 0; jj < NR; ++jj)
+                            dst[jj] = T(src[jj]);
+                    } else {
+                        for (uint jj = 0; jj < nr; ++jj)
+                            dst[jj] = T(b(p, j + jj));
+                        for (uint jj = nr; jj < NR; ++jj)
+                            dst[jj] = 0;
+                    }
+                    dst += NR;
+                }
+            }
+        }
+
+        /**
+         * \brief Multiply an MR x kc sliver of A with a kc x NR sliver of B.
+         *
+         * The MR x NR accumulator is kept in MR * 2 vector registers:
+         * each step broadcasts one element of A and multiplies it with
+         * one row of B.
+         *
+         * The result is scaled by alpha and added to (the top-left mr x nr
+         * corner of) C. When `first` is set, C is overwritten instead.
+         * When `last` is set, the epilogue is applied on the way out;
+         * `col` is the column of C the tile starts at.
+         */
+        template<typename T, typename E>
+        inline void micro_kernel(uint kc,
+                                 const T *__restrict a,
+                                 const T *__restrict b,
+                                 T *__restrict c, size_t ldc,
+                                 uint mr, uint nr,
+                                 T alpha, bool first,
+                                 bool last, const E &epilogue, size_t col) {
+            constexpr uint MR = params<T>::MR;
+            constexpr uint NR = params<T>::NR;
+            constexpr uint VW = vector_bytes / sizeof(T);
+            constexpr uint NV = NR / VW;
+
+            typedef T vec __attribute__((vector_size(vector_bytes)));
+
+            vec ab[MR][NV] = { };
+
+            for (uint p = 0; p < kc; ++p) {
+                vec bv[NV];
+                for (uint j = 0; j < NV; ++j)
+                    bv[j] = *reinterpret_cast<const vec*>(b + j*VW);
+                for (uint i = 0; i < MR; ++i) {
+                    vec av = a[i] - vec { };
+                    for (uint j = 0; j < NV; ++j)
+                        ab[i][j] += av * bv[j];
+                }
+                a += MR;
+                b += NR;
+            }
+
+            if (mr == MR && nr == NR) {
+                for (uint i = 0; i < MR; ++i) {
+                    for (uint j = 0; j < NV; ++j) {
+                        vec cv;
+                        __builtin_memcpy(&cv, c + i*ldc + j*VW, sizeof cv);
+                        cv = (first ? vec { } : cv) + alpha * ab[i][j];
+                        if (last)
+                            cv = epilogue(cv, col + j*VW);
+                        __builtin_memcpy(c + i*ldc + j*VW, &cv, sizeof cv);
+                    }
+                }
+            } else {
+                alignas(vector_bytes) T t[MR][NR];
+                __builtin_memcpy(t, ab, sizeof t);
+                for (uint i = 0; i < mr; ++i)
+                    for (uint j = 0; j < nr; ++j)
+                        t[i][j] = (first ? 0 : c[i*ldc + j]) + alpha * t[i][j];
+                if (last) {
+                    // Whole vectors, even past the edge: far cheaper
+                    // than one element at a time.
+                    for (uint i = 0; i < mr; ++i) {
+                        for (uint j = 0; j < NV; ++j) {
+                            vec x;
+                            __builtin_memcpy(&x, &t[i][j*VW], sizeof x);
+                            x = epilogue(x, col + j*VW);
+                            __builtin_memcpy(&t[i][j*VW], &x, sizeof x);
+                        }
+                    }
+                }
+                for (uint i = 0; i < mr; ++i)
+                    for (uint j = 0; j < nr; ++j)
+                        c[i*ldc + j] = t[i][j];
+            }
+        }
+    }
+
+    /**
+     * \brief General matrix multiplication.
+     *
+     * Computes C = alpha * A * B (+ C, if `accumulate` is set), where
+     * A is m x k, B is k x n and C is a row-major m x n matrix with
+     * leading dimension ldc.
+     *
+     * A and B may be stored as any type that converts to T.
+     *
+     * The epilogue (see no_epilogue) is applied to every element of C
+     * once, after its final value has been computed.
+     */
+    template<typename T, typename SA, typename SB, typename E = no_epilogue>
+    void gemm(uint m, uint n, uint k,
+              T alpha,
+              operand<SA> a,
+              operand<SB> b,
+              T *c, size_t ldc,
+              bool accumulate = false,
+              const E &epilogue = { }) {
+
+        using P = params<T>;
+
+        thread_local detail::scratch<T> a_buf;
+        thread_local detail::scratch<T> b_buf;
+
+        const uint nc_max = std::min<uint>(P::NC, (n + P::NR - 1) / P::NR * P::NR);
+        const uint mc_max = std::min<uint>(P::MC, (m + P::MR - 1) / P::MR * P::MR);
+        const uint kc_max = std::min<uint>(P::KC, k);
+
+        T *bp = b_buf.get(size_t(kc_max) * nc_max);
+        T *ap = a_buf.get(size_t(kc_max) * mc_max);
+
+        for (uint jc = 0; jc < n; jc += P::NC) {
+            uint nc = std::min(P::NC, n - jc);
+
+            for (uint pc = 0; pc < k; pc += P::KC) {
+                uint kc    = std::min(P::KC, k - pc);
+                bool first = !accumulate && pc == 0;
+                bool last  = pc + kc == k;
+
+                detail::pack_b(kc, nc, operand<SB> { &b(pc, jc), b.rs, b.cs }, bp);
+
+                for (uint ic = 0; ic < m; ic += P::MC) {
+                    uint mc = std::min(P::MC, m - ic);
+
+                    detail::pack_a(mc, kc, operand<SA> { &a(ic, pc), a.rs, a.cs }, ap);
+
+                    for (uint jr = 0; jr < nc; jr += P::NR) {
+                        uint nr = std::min(P::NR, nc - jr);
+                        for (uint ir = 0; ir < mc; ir += P::MR) {
+                            uint mr = std::min(P::MR, mc - ir);
+                            detail::micro_kernel(kc,
+                                                 ap + size_t(ir) * kc,
+                                                 bp + size_t(jr) * kc,
+                                                 c + size_t(ic + ir) * ldc + jc + jr, ldc,
+                                                 mr, nr,
+                                                 alpha, first,
+                                                 last, epilogue, jc + jr);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * \brief Whether an m x k by k x n product is big enough to pay for packing.
+     *
+     * For very short inner dimensions, the plain dot-product loop in
+     * Matrix::dot (which the compiler unrolls completely) wins.
+     */
+    template<typename T>
+    constexpr bool worth_it(size_t m, size_t n, size_t k) {
+        return k >= 16 && m * n * k >= 16 * 16 * 16;
+    }
+}
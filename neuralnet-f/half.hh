@@ -0,0 +1,105 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief 16-bit floating point storage types.
+ *
+ * These are for storing weights only: they convert to and from float,
+ * and all arithmetic is done in float (or wider). The GEMM kernel
+ * widens them while packing, so a product with a 16-bit operand reads
+ * half the memory of a float one and accumulates in float.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace half {
+
+    namespace detail {
+        inline uint32_t bits(float f)      { uint32_t u; std::memcpy(&u, &f, 4); return u; }
+        inline float    from_bits(uint32_t u) { float f; std::memcpy(&f, &u, 4); return f; }
+    }
+
+    /**
+     * \brief bfloat16: the upper half of a float (8 exponent bits, 7 mantissa bits).
+     */
+    struct bf16 {
+        uint16_t bits = 0;
+
+        bf16() = default;
+
+        explicit bf16(float f) {
+            uint32_t u = detail::bits(f);
+            if ((u & 0x7fffffff) > 0x7f800000)
+                bits = (u >> 16) | 0x40; // Keep NaNs quiet NaNs.
+            else
+                bits = (u + 0x7fff + ((u >> 16) & 1)) >> 16; // Round to nearest even.
+        }
+
+        operator float() const { return detail::from_bits(uint32_t(bits) << 16); }
+    };
+
+    /**
+     * \brief IEEE 754 binary16 (5 exponent bits, 10 mantissa bits).
+     */
+    struct fp16 {
+        uint16_t bits = 0;
+
+        fp16() = default;
+
+        explicit fp16(float f) {
+            uint32_t u    = detail::bits(f);
+            uint32_t sign = (u >> 16) & 0x8000;
+            uint32_t a    = u & 0x7fffffff;
+
+            if (a > 0x7f800000) {
+                bits = sign | 0x7e00;                     // NaN.
+            } else if (a >= 0x477ff000) {
+                bits = sign | 0x7c00;                     // Overflows to infinity.
+            } else if (a < 0x38800000) {
+                // Subnormal (or zero): let the FPU do the rounding by
+                // adding a number whose ulp is the smallest subnormal.
+                float r = detail::from_bits(a) + 0.5f;
+                bits = sign | uint16_t(detail::bits(r) - detail::bits(0.5f));
+            } else {
+                // Normal: rebias the exponent and round to nearest even.
+                uint32_t m = a + ((uint32_t(15 - 127) << 23) + 0xfff) + ((a >> 13) & 1);
+                bits = sign | uint16_t(m >> 13);
+            }
+        }
+
+        operator float() const {
+            uint32_t sign = uint32_t(bits & 0x8000) << 16;
+            uint32_t e    = (bits >> 10) & 0x1f;
+            uint32_t m    = bits & 0x3ff;
+
+            if (e == 0x1f)                                // Inf / NaN.
+                return detail::from_bits(sign | 0x7f800000 | (m << 13));
+            if (e == 0)                                   // Zero / subnormal.
+                return detail::from_bits(sign | detail::bits(float(m) * (1.0f / (1 << 24))));
+            return detail::from_bits(sign | ((e + 127 - 15) << 23) | (m << 13));
+        }
+    };
+
+    template<typename T>
+    struct is_half : std::false_type { };
+    template<> struct is_half<bf16> : std::true_type { };
+    template<> struct is_half<fp16> : std::true_type { };
+}
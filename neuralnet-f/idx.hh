@@ -19,112 +19,25 @@
 #include "common.hh"
 #include "matrix.hh"
 #include "nn.hh"
+#include "parallel.hh"
+#include "idx_file.hh"
+#include "loader.hh"
+#include "rng.hh"
+#include "checkpoint.hh"
+#include "conv.hh"
+#include "dynamic.hh"
+#include "optim.hh"
+#include "quant.hh"
+#include <chrono>
 #include <vector>
 #include <iostream>
-#include <fstream>
+#include <stdexcept>
 #include <string_view>
 
 namespace idx {
 
-    template<typename T>
-    [[nodiscard]] constexpr T big_little_swap(T v) {
-        static_assert(std::is_integral<T>::value, "T must be of integral type");
-        static_assert(std::is_unsigned<T>::value, "swap is only defined for unsigned types");
-        alignas(T) uint8_t r[sizeof(T)] = {};
-        for (size_t i = 0; i < sizeof(T); ++i)
-            r[i] = ((uint8_t*)&v)[sizeof(T)-i-1];
-        T *x = (T*)r;
-        return *x;
-    }
-
-    template<typename T>
-    bool get_the_thing_from_the_thing(std::istream &is, T &v) {
-        is.read((char*)&v, sizeof(T));
-        return (bool)is;
-    }
-
-    template<typename = void> /* hush */
-    std::vector<uint8_t> read_idx1(std::string_view filename) {
-        constexpr auto max_records = 1'000'000;
-        std::ifstream file(std::string(filename), std::ios::binary);
-        if (!file)
-            throw std::runtime_error("Could not open label file");
-        file.seekg(0, std::ios::end);
-        size_t size = file.tellg();
-        file.seekg(0, std::ios::beg);
-
-        if (size < 8)
-            throw std::runtime_error("short short too short for NN");
-
-        { uint32_t magic;
-          if (!get_the_thing_from_the_thing(file, magic)
-              || magic != big_little_swap(2049U)) {
-
-              throw std::runtime_error("magic number mismatch");
-          } }
-
-        uint32_t record_count;
-        get_the_thing_from_the_thing(file, record_count);
-        record_count = big_little_swap(record_count);
-
-        std::cout << "records: " << record_count << "\n";
-        if (record_count > max_records)
-            throw std::runtime_error("too many records");
-
-        std::vector<uint8_t> result;
-        result.resize(record_count);
-        if (!file.read((char*)result.data(), record_count))
-            throw std::runtime_error("could not read records");
-
-        return result;
-    }
-
-    // constexpr unsigned Rows = 28;
-    // constexpr unsigned Cols = 28;
-    // constexpr auto max_records = 1'000'000;
-
-    template<uint Rows, uint Cols, uint max_records = 1'000'000>
-    std::vector<uint8_t> read_idx3(std::string_view filename) {
-
-        std::ifstream file(std::string(filename), std::ios::binary);
-        if (!file)
-            throw std::runtime_error("Could not open data file");
-        file.seekg(0, std::ios::end);
-        size_t size = file.tellg();
-        file.seekg(0, std::ios::beg);
-
-        if (size < 4*4)
-            throw std::runtime_error("short short too short for NN");
-
-        { uint32_t magic;
-          if (!get_the_thing_from_the_thing(file, magic)
-              || magic != big_little_swap(2051U)) {
-
-              throw std::runtime_error("magic number mismatch");
-          } }
-
-        uint32_t record_count; get_the_thing_from_the_thing(file, record_count);
-        record_count = big_little_swap(record_count);
-
-        std::cout << "records: " << record_count << "\n";
-        if (record_count > max_records)
-            throw std::runtime_error("too many records");
-
-        uint32_t rows; get_the_thing_from_the_thing(file, rows);
-        uint32_t cols; get_the_thing_from_the_thing(file, cols);
-        if (rows != big_little_swap(Rows) || cols != big_little_swap(Cols))
-            throw std::runtime_error("image dims do not match");
-
-        std::vector<uint8_t> result;
-        result.resize(record_count * Rows * Cols);
-        if (!file.read((char*)result.data(), record_count * Rows * Cols))
-            throw std::runtime_error("could not read records");
-
-        return result;
-    }
-
-    template<uint SZ,uint W, uint H>
-    void print_images(const Matrixd<SZ, W*H> &n) {
+    template<uint SZ,uint W, uint H, typename T = double>
+    void print_images(const Matrix<T, SZ, W*H> &n) {
         for(int i = 1; i <= SZ; ++i) {
             for (int y = 1; y <= H; ++y) {
                 for (int j = 1; j <= W; ++j) {
@@ -145,100 +58,432 @@ namespace idx {
         }
     }
 
+    /**
+     * \brief Count the rows of A whose outputs are all on the right side of 0.5.
+     */
+    template<typename AT, typename YT>
+    int count_correct(const AT &A, const YT &Y) {
+        int correct = 0;
+        for (uint r = 1; r <= A.nrows; ++r) {
+            bool waarom_heeft_cpp_geen_continues_naar_outer_loops = false;
+            for (uint c = 1; c <= A.ncols; ++c) {
+                if ((A(r,c) > 0.5) != (Y(r,c) > 0.5)) {
+                    waarom_heeft_cpp_geen_continues_naar_outer_loops = true;
+                    break;
+                }
+            }
+            if (!waarom_heeft_cpp_geen_continues_naar_outer_loops)
+                ++correct;
+        }
+        return correct;
+    }
+
+    /**
+     * \brief Count the rows of A whose largest output is where Y has its largest.
+     *
+     * For one-hot labels, this is the amount of correct classifications.
+     */
+    template<typename AT, typename YT>
+    int count_argmax(const AT &A, const YT &Y) {
+        int correct = 0;
+        for (uint r = 1; r <= A.nrows; ++r) {
+            uint best_a = 1, best_y = 1;
+            for (uint c = 2; c <= A.ncols; ++c) {
+                if (A(r,c) > A(r,best_a)) best_a = c;
+                if (Y(r,c) > Y(r,best_y)) best_y = c;
+            }
+            correct += best_a == best_y;
+        }
+        return correct;
+    }
+
+    /// Correct rows of A, as counted for the kind of output layer.
+    template<typename Output, typename AT, typename YT>
+    int count_correct(const AT &A, const YT &Y) {
+        if constexpr (std::is_same<Output, nn::sigmoid_mse>::value)
+            return count_correct(A, Y);
+        else
+            return count_argmax(A, Y);
+    }
+
+    /// How well a net did on a test set.
+    struct Score {
+        double loss; ///< Mean over test batches.
+        int correct;
+        int total;
+    };
+
+    namespace detail {
+
+        /**
+         * \brief Score a net on every batch of a test set.
+         *
+         * forward(X) gives the activations of the output layer for a
+         * batch, as a Matrix.
+         */
+        template<typename Output, typename Loader, typename F>
+        Score test(Loader &test, F forward) {
+            int correct       = 0;
+            int total         = 0;
+            double total_loss = 0;
+
+            for (size_t j = 0; j < test.batches(); ++j) {
+                auto &b = test.next();
+                const auto &X_test = b.X;
+                const auto &Y_test = b.Y;
+                // print_images<batch_size,28,28>(X_test);
+
+                auto A = forward(X_test);
+
+                //std::cout << "A:\n" << A;
+                //std::cout << "Y:\n" << Y_test;
+                auto loss = Output::loss(A, Y_test);
+                std::cout << "Δ:\n" << (A - Y_test);
+                if constexpr (std::is_same<Output, nn::sigmoid_mse>::value)
+                    std::cout << "MSE:\n" << loss << "\n";
+                else
+                    std::cout << "Loss:\n" << loss << "\n";
+
+                total_loss += loss;
+
+                total   += A.nrows;
+                correct += count_correct<Output>(A, Y_test);
+            }
+            std::cout << "Correct:  " << correct << "/" << total << "\n";
+            std::cout << "Percentage:  " << double(correct) / double(total) * 100.0 << "\n";
+
+            return { total_loss / test.batches(), correct, total };
+        }
+    }
+
     template<typename Net>
     struct RunResult {
         Net net;
-        double mse;
+        double loss; ///< Mean over test batches, see the Output of run().
         int correct;
         int total;
     };
 
+    /**
+     * \brief Train and test a net on an IDX data set (e.g. MNIST).
+     *
+     * \tparam Net     The type of net to train, e.g. from nn::make_net or
+     *                 nn::make_conv_net.
+     * \tparam shards  Train on this many parts of each batch in parallel
+     *                 (see parallel.hh). 1 trains serially.
+     * \tparam T       Element type to train with (float or double).
+     * \tparam S       Element type to store weights in while testing.
+     *                 This may be a 16-bit type (half::bf16, half::fp16),
+     *                 products are still computed in T.
+     * \tparam Output  The kind of output layer (see nn.hh). With
+     *                 nn::softmax_cross_entropy, a record counts as
+     *                 correct when its most likely class is right.
+     * \param  seed    Seed for weight initialization and sampling.
+     *                 Runs with the same seed give the same net.
+     * \param  order   The order to visit training records in, see sampler.hh.
+     * \param  threads Amount of threads to train with when shards > 1,
+     *                 0 for one per hardware thread.
+     *                 This does not affect the outcome.
+     * \param  checkpoint_file If not empty, the net is saved here after every round
+     *                 (see checkpoint.hh).
+     * \param  rule    Update rule, see optim.hh.
+     * \param  schedule Learning rate schedule, see optim.hh.
+     *
+     * Batches are prepared on a separate thread, see loader.hh.
+     */
+    template<typename Net,
+             uint rows, uint cols,
+             uint batch_size,
+             uint shards = 1,
+             typename S = typename std::tuple_element_t<0, Net>::value_type,
+             typename Output = nn::sigmoid_mse,
+             typename Rule = optim::sgd,
+             typename Schedule = optim::constant>
+    auto run_net(std::string_view train_images,
+                 std::string_view train_labels,
+                 std::string_view test_images,
+                 std::string_view test_labels,
+                 int training_rounds,
+                 uint64_t seed = 0,
+                 sampling order = sampling::sequential,
+                 uint threads = 0,
+                 std::string_view checkpoint_file = { },
+                 Rule rule = { },
+                 Schedule schedule = { }) {
+
+        using T = typename std::tuple_element_t<0, Net>::value_type;
+
+        constexpr auto input_layer_size  = rows*cols;
+        constexpr auto output_layer_size = std::tuple_element_t<std::tuple_size<Net>::value - 1, Net>::ncols;
+
+        static_assert(nn::net_inputs<Net> == input_layer_size, "The net's inputs do not match the images");
+
+        using loader = batch_loader<T, batch_size, input_layer_size, output_layer_size>;
+
+        file label_file = read_idx1(train_labels);
+        file image_file = read_idx3<rows,cols>(train_images);
+
+        // This does the thing.
+        Net net;
+
+        rng::xoshiro256ss init(seed, rng::init_stream);
+        // Random weights; biases start at zero, so that the first
+        // batches do not push whole layers into saturation.
+        nn::for_each_layer(net, [&](auto &W, auto &b) {
+            W.mip([&](auto) { return rng::uniform<T>(init, -1, 1); });
+            b.mip([](auto) { return T(0); });
+        });
+
+        nn::parallel_trainer<shards, decltype(net)> trainer(threads);
+        optim::optimizer<decltype(net), Rule, Schedule> optimizer(rule, schedule);
+        if constexpr (shards > 1)
+            std::cout << "training on " << trainer.threads() << " threads, "
+                      << shards << " shards per batch\n";
+
+        {
+            loader training(image_file, label_file, training_rounds, order, seed);
+
+            for (auto i = 0; i < training_rounds; ++i) {
+                std::cout << "round " << (i+1) << "/" << training_rounds << "\n";
+                for (uint j = 0; j < training.batches_per_epoch() /*j < 1*/; ++j) {
+                    auto &b = training.next();
+                    const auto &X_training = b.X;
+                    const auto &Y_training = b.Y;
+                    if constexpr (shards > 1) {
+                        optimizer.step();
+                        trainer.template train<Output>(X_training, Y_training, net, optimizer);
+                    } else {
+                        optimizer.template train<Output>(X_training, Y_training, net);
+                    }
+                }
+                if (!checkpoint_file.empty())
+                    checkpoint::save(checkpoint_file, net);
+            }
+        }
+
+        label_file = read_idx1(test_labels);
+        image_file = read_idx3<rows,cols>(test_images);
+
+        loader test(image_file, label_file);
+
+        // The weights to test with, possibly in a narrower type.
+        auto test_net = std::apply([](const auto&...W) {
+                                       return std::make_tuple(nn::cast<S>(W)...);
+                                   }, net);
+
+        Score score = detail::test<Output>(test, [&](const auto &X) {
+                return std::apply([&](auto&...x) { return nn::forwards<Output>(X, x...); }, test_net);
+            });
+
+        return RunResult<decltype(net)> { net, score.loss, score.correct, score.total };
+    }
+
+    /**
+     * \brief Train and test a fully connected net (see nn::make_net) on an
+     *        IDX data set, see run_net.
+     */
     template<uint rows, uint cols,
              uint output_layer_size,
              uint batch_size,
              uint hidden_layers,
-             uint neurons_per_layer>
+             uint neurons_per_layer,
+             uint shards = 1,
+             typename T = double,
+             typename S = T,
+             typename Output = nn::sigmoid_mse,
+             typename Rule = optim::sgd,
+             typename Schedule = optim::constant>
     auto run(std::string_view train_images,
              std::string_view train_labels,
              std::string_view test_images,
              std::string_view test_labels,
-             int training_rounds) {
+             int training_rounds,
+             uint64_t seed = 0,
+             sampling order = sampling::sequential,
+             uint threads = 0,
+             std::string_view checkpoint_file = { },
+             Rule rule = { },
+             Schedule schedule = { }) {
+        return run_net<nn::make_net<T, rows*cols, output_layer_size, hidden_layers, neurons_per_layer>,
+                       rows, cols, batch_size, shards, S, Output>(train_images, train_labels,
+                                                                  test_images, test_labels,
+                                                                  training_rounds, seed, order, threads,
+                                                                  checkpoint_file, rule, schedule);
+    }
+
+    /**
+     * \brief Train and test a net shaped at run time (see dynamic.hh) on
+     *        an IDX data set.
+     *
+     * Like run(), with plain gradient descent at learn rate `eta`. With
+     * the same seed, the net starts out with the same weights as the
+     * static net that run() would make.
+     */
+    template<uint rows, uint cols,
+             uint output_layer_size,
+             uint batch_size,
+             typename T = double,
+             typename Output = nn::sigmoid_mse>
+    RunResult<dyn::net<T>> run_dynamic(uint hidden_layers,
+                                       uint neurons_per_layer,
+                                       std::string_view train_images,
+                                       std::string_view train_labels,
+                                       std::string_view test_images,
+                                       std::string_view test_labels,
+                                       int training_rounds,
+                                       uint64_t seed = 0,
+                                       sampling order = sampling::sequential,
+                                       double eta = nn::eta) {
 
         constexpr auto input_layer_size = rows*cols;
 
-        Matrixd<batch_size,  input_layer_size> X_training;
-        Matrixd<batch_size, output_layer_size> Y_training;
-        Matrixd<batch_size,  input_layer_size> X_test;
-        Matrixd<batch_size, output_layer_size> Y_test;
+        using loader = batch_loader<T, batch_size, input_layer_size, output_layer_size>;
 
-        auto label_buffer = read_idx1(train_labels);
-        auto data_buffer  = read_idx3<rows,cols>(train_images);
+        file label_file = read_idx1(train_labels);
+        file image_file = read_idx3<rows,cols>(train_images);
 
-        // This does the thing.
-        auto net = nn::make_net<double,
-                                input_layer_size,
-                                output_layer_size,
-                                hidden_layers,
-                                neurons_per_layer>();
-
-        std::apply([](auto& ...x){(x.mip([](auto) {return (double)rand()/RAND_MAX*2 - 1;}), ...);}, net);
-
-        for (auto i = 0; i < training_rounds; ++i) {
-            std::cout << "round " << (i+1) << "/" << training_rounds << "\n";
-            for (uint j = 0; j < label_buffer.size() / batch_size /*j < 1*/; ++j) {
-                X_training *= 0; Y_training *= 0;
-                for (uint k = 0; k < batch_size; ++k) {
-                    for (uint l = 0; l < input_layer_size; ++l)
-                        X_training(k+1, l+1) = (double)data_buffer[j*batch_size*input_layer_size + k*input_layer_size + l] / 255;
-                    Y_training(k+1, label_buffer[j*batch_size + k]+1) = 1;
+        dyn::net<T> net({ input_layer_size, output_layer_size, hidden_layers, neurons_per_layer });
+        dyn::workspace<T> ws;
+
+        rng::xoshiro256ss init(seed, rng::init_stream);
+        dyn::for_each_layer(net, [&](auto &W, auto &) {
+            std::generate(W.data(), W.data() + W.size(), [&] { return rng::uniform<T>(init, -1, 1); });
+        });
+
+        {
+            loader training(image_file, label_file, training_rounds, order, seed);
+
+            for (auto i = 0; i < training_rounds; ++i) {
+                std::cout << "round " << (i+1) << "/" << training_rounds << "\n";
+                for (uint j = 0; j < training.batches_per_epoch(); ++j) {
+                    auto &b = training.next();
+                    dyn::train<Output>(b.X.data(), b.Y.data(), batch_size, net, ws, T(eta));
                 }
-                std::apply([&](auto&...x) { nn::train(X_training, Y_training, x...); }, net);
             }
         }
 
-        label_buffer = read_idx1(test_labels);
-        data_buffer  = read_idx3<rows,cols>(test_images);
+        label_file = read_idx1(test_labels);
+        image_file = read_idx3<rows,cols>(test_images);
 
-        int correct      = 0;
-        int total        = 0;
-        double total_mse = 0;
+        loader test(image_file, label_file);
 
-        for (size_t j = 0; j < label_buffer.size() / batch_size; ++j) {
-            X_test *= 0; Y_test *= 0;
-            for (uint k = 0; k < batch_size; ++k) {
-                for (uint l = 0; l < input_layer_size; ++l)
-                    X_test(k+1, l+1) = (double)data_buffer[j*batch_size*input_layer_size + k*input_layer_size + l] / 255;
-                Y_test(k+1, label_buffer[j*batch_size + k]+1) = 1;
-                // print_images<batch_size,28,28>(X_test);
-            }
-            auto A = std::apply([&](auto&...x) { return nn::forwards(X_test, x...); }, net);
-
-            //std::cout << "A:\n" << A;
-            //std::cout << "Y:\n" << Y_test;
-            auto mse = nn::get_mse(A, Y_test);
-            std::cout << "Δ:\n" << (A - Y_test);
-            std::cout << "MSE:\n" << mse << "\n";
-
-            total_mse += mse;
-
-            for (uint r = 1; r <= A.nrows; ++r) {
-                ++total;
-                bool waarom_heeft_cpp_geen_continues_naar_outer_loops = false;
-                for (uint c = 1; c <= A.ncols; ++c) {
-                    if ((A(r,c) > 0.5) != (Y_test(r,c) > 0.5)) {
-                        waarom_heeft_cpp_geen_continues_naar_outer_loops = true;
-                        break;
-                    }
+        auto A = std::make_unique<Matrix<T,batch_size,output_layer_size>>(matrix_detail::uninitialized);
+        Score score = detail::test<Output>(test, [&](const auto &X) -> const auto& {
+                const auto &out = dyn::forwards<Output>(X.data(), batch_size, net, ws);
+                std::copy(out.data(), out.data() + out.size(), A->data());
+                return *A;
+            });
+
+        return { std::move(net), score.loss, score.correct, score.total };
+    }
+
+    /**
+     * \brief Train and test a net with a shape chosen at run time.
+     *
+     * Shapes listed in Static (as dyn::static_shape) are trained by run(),
+     * on a static net, others by run_dynamic(). Either way with plain
+     * gradient descent at learn rate `eta`, so the outcome does not
+     * depend on which it was.
+     */
+    template<uint rows, uint cols,
+             uint output_layer_size,
+             uint batch_size,
+             typename T,
+             typename Output,
+             typename... Static>
+    Score sweep(uint hidden_layers,
+                uint neurons_per_layer,
+                std::string_view train_images,
+                std::string_view train_labels,
+                std::string_view test_images,
+                std::string_view test_labels,
+                int training_rounds,
+                uint64_t seed = 0,
+                sampling order = sampling::sequential,
+                double eta = nn::eta) {
+
+        return dyn::dispatch<Static...>(
+            { rows*cols, output_layer_size, hidden_layers, neurons_per_layer },
+            [&](auto s) {
+                using S = decltype(s);
+                auto r = run<rows, cols, output_layer_size, batch_size,
+                             S::hidden_layers, S::neurons_per_layer,
+                             1, T, T, Output>(train_images, train_labels, test_images, test_labels,
+                                              training_rounds, seed, order, 0, { },
+                                              optim::sgd { }, optim::constant { eta });
+                return Score { r.loss, r.correct, r.total };
+            },
+            [&](const dyn::shape &) {
+                auto r = run_dynamic<rows, cols, output_layer_size, batch_size, T, Output>
+                             (hidden_layers, neurons_per_layer,
+                              train_images, train_labels, test_images, test_labels,
+                              training_rounds, seed, order, eta);
+                return Score { r.loss, r.correct, r.total };
+            });
+    }
+
+    /**
+     * \brief Compare int8 inference (see quant.hh) with the float path on a test set.
+     *
+     * Prints accuracy and time per sample of both, and how often they
+     * agree on the most likely class.
+     */
+    template<uint batch_size, typename Output = nn::sigmoid_mse, typename Net>
+    void quantization_report(const Net &net,
+                             std::string_view test_images,
+                             std::string_view test_labels) {
+        using clock = std::chrono::steady_clock;
+        using T     = typename std::tuple_element_t<0, Net>::value_type;
+        constexpr uint inputs  = nn::net_inputs<Net>;
+        constexpr uint outputs = std::tuple_element_t<std::tuple_size<Net>::value - 1, Net>::ncols;
+
+        file label_file = read_idx1(test_labels);
+        file image_file(test_images);
+        batch_loader<T, batch_size, inputs, outputs> test(image_file, label_file);
+
+        auto qnet = quant::quantize(net);
+
+        int    correct_f = 0, correct_q = 0, agree = 0, total = 0;
+        double max_diff  = 0;
+        clock::duration t_f { }, t_q { };
+
+        for (size_t j = 0; j < test.batches(); ++j) {
+            auto &b = test.next();
+
+            auto t0 = clock::now();
+            auto Af = std::apply([&](auto&...W) { return nn::forwards<Output>(b.X, W...); }, net);
+            auto t1 = clock::now();
+            auto Aq = quant::forwards<Output>(b.X, qnet);
+            auto t2 = clock::now();
+            t_f += t1 - t0;
+            t_q += t2 - t1;
+
+            total     += batch_size;
+            correct_f += count_correct<Output>(Af, b.Y);
+            correct_q += count_correct<Output>(Aq, b.Y);
+
+            for (uint r = 1; r <= batch_size; ++r) {
+                uint best_f = 1, best_q = 1;
+                for (uint c = 1; c <= outputs; ++c) {
+                    if (Af(r,c) > Af(r,best_f)) best_f = c;
+                    if (Aq(r,c) > Aq(r,best_q)) best_q = c;
+                    max_diff = std::max(max_diff, std::abs(double(Af(r,c)) - double(Aq(r,c))));
                 }
-                if (!waarom_heeft_cpp_geen_continues_naar_outer_loops)
-                    ++correct;
+                agree += best_f == best_q;
             }
         }
-        std::cout << "Correct:  " << correct << "/" << total << "\n";
-        std::cout << "Percentage:  " << double(correct) / double(total) * 100.0 << "\n";
-
-        return RunResult<decltype(net)> { net, total_mse/(label_buffer.size() / batch_size),
-                                          correct, total };
+        if (!total)
+            return;
+
+        auto ns = [&](clock::duration d) {
+            return std::chrono::duration<double,std::nano>(d).count() / total;
+        };
+        std::cout << "quantization report (" << total << " samples)\n"
+                  << "  " << sizeof(T)*8 << "-bit: " << double(correct_f) / total * 100.0 << "% correct, "
+                  << ns(t_f) << " ns/sample\n"
+                  << "  int8:   " << double(correct_q) / total * 100.0 << "% correct, "
+                  << ns(t_q) << " ns/sample (x" << ns(t_f) / ns(t_q) << ")\n"
+                  << "  same class: " << double(agree) / total * 100.0 << "%, "
+                  << "largest output difference: " << max_diff << "\n";
     }
-
 }
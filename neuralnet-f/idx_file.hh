@@ -0,0 +1,251 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief The IDX file format.
+ *
+ * See http://yann.lecun.com/exdb/mnist/ for a description.
+ */
+
+#include "common.hh"
+#include "mapped_file.hh"
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace idx {
+
+    template<typename T>
+    [[nodiscard]] constexpr T big_little_swap(T v) {
+        static_assert(std::is_integral<T>::value, "T must be of integral type");
+        static_assert(std::is_unsigned<T>::value, "swap is only defined for unsigned types");
+        alignas(T) uint8_t r[sizeof(T)] = {};
+        for (size_t i = 0; i < sizeof(T); ++i)
+            r[i] = ((uint8_t*)&v)[sizeof(T)-i-1];
+        T *x = (T*)r;
+        return *x;
+    }
+
+    /// IDX element types, as encoded in the third byte of the magic number.
+    enum class type : uint8_t {
+        ubyte   = 0x08,
+        sbyte   = 0x09,
+        short_  = 0x0B,
+        int_    = 0x0C,
+        float_  = 0x0D,
+        double_ = 0x0E,
+    };
+
+    template<typename T> constexpr bool is_element = false;
+    template<> constexpr bool is_element<uint8_t> = true;
+    template<> constexpr bool is_element<int8_t>  = true;
+    template<> constexpr bool is_element<int16_t> = true;
+    template<> constexpr bool is_element<int32_t> = true;
+    template<> constexpr bool is_element<float>   = true;
+    template<> constexpr bool is_element<double>  = true;
+
+    /// The IDX type for C++ element type T.
+    template<typename T>
+    constexpr type type_of = std::is_same<T,uint8_t>::value ? type::ubyte
+                           : std::is_same<T,int8_t>::value  ? type::sbyte
+                           : std::is_same<T,int16_t>::value ? type::short_
+                           : std::is_same<T,int32_t>::value ? type::int_
+                           : std::is_same<T,float>::value   ? type::float_
+                           :                                  type::double_;
+
+    /// Size of an element in bytes, 0 for unknown types.
+    constexpr size_t size_of(type t) {
+        switch (t) {
+        case type::ubyte:   return 1;
+        case type::sbyte:   return 1;
+        case type::short_:  return 2;
+        case type::int_:    return 4;
+        case type::float_:  return 4;
+        case type::double_: return 8;
+        }
+        return 0;
+    }
+
+    /// Read a big-endian T.
+    template<typename T>
+    T load_big(const unsigned char *p) {
+        using U = std::conditional_t<sizeof(T) == 1, uint8_t,
+                  std::conditional_t<sizeof(T) == 2, uint16_t,
+                  std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>>>;
+        U u = 0;
+        for (size_t i = 0; i < sizeof(T); ++i)
+            u = U(u << 8 | p[i]);
+        T v;
+        std::memcpy(&v, &u, sizeof v);
+        return v;
+    }
+
+    /**
+     * \brief A view on a run of big-endian elements in an IDX file.
+     *
+     * Nothing is copied: elements are converted to host byte order as
+     * they are read.
+     */
+    template<typename T>
+    class span {
+        const unsigned char *p = nullptr;
+        size_t               n = 0;
+
+    public:
+        span() = default;
+        span(const unsigned char *p, size_t n) : p(p), n(n) { }
+
+        size_t size() const { return n; }
+
+        /// The raw (big-endian) bytes.
+        const unsigned char *bytes() const { return p; }
+
+        T operator[](size_t i) const {
+            if constexpr (sizeof(T) == 1)
+                return static_cast<T>(p[i]);
+            else
+                return load_big<T>(p + i * sizeof(T));
+        }
+
+        span subspan(size_t offset, size_t count) const {
+            return { p + offset * sizeof(T), count };
+        }
+    };
+
+    /**
+     * \brief A memory-mapped IDX file.
+     *
+     * The header is validated on construction. The first dimension is
+     * the amount of records, the remaining ones give the shape of a
+     * single record.
+     */
+    class file {
+        mapped_file           map;
+        idx::type             t = type::ubyte;
+        std::vector<uint32_t> dims_;
+        size_t                record_size_ = 1;
+        const unsigned char  *data_ = nullptr;
+
+    public:
+        file() = default;
+
+        explicit file(std::string_view filename)
+            : map(filename) {
+
+            const unsigned char *p = map.data();
+            size_t size = map.size();
+
+            if (size < 4 || p[0] != 0 || p[1] != 0)
+                throw std::runtime_error("magic number mismatch");
+
+            t = static_cast<idx::type>(p[2]);
+            if (!size_of(t))
+                throw std::runtime_error("unknown IDX element type");
+
+            uint ndims = p[3];
+            if (!ndims)
+                throw std::runtime_error("IDX file has no dimensions");
+
+            size_t header = 4 + 4 * size_t(ndims);
+            if (size < header)
+                throw std::runtime_error("short short too short for NN");
+
+            for (uint i = 0; i < ndims; ++i)
+                dims_.push_back(load_big<uint32_t>(p + 4 + 4*i));
+
+            for (uint i = 1; i < ndims; ++i) {
+                if (dims_[i] && record_size_ > SIZE_MAX / dims_[i])
+                    throw std::runtime_error("IDX record size overflows");
+                record_size_ *= dims_[i];
+            }
+
+            if (record_size_ && (size - header) / size_of(t) / record_size_ < dims_[0])
+                throw std::runtime_error("IDX file is truncated");
+
+            data_ = p + header;
+        }
+
+        idx::type type() const { return t; }
+
+        /// All dimensions, including the record count.
+        const std::vector<uint32_t> &dims() const { return dims_; }
+
+        /// Amount of records.
+        size_t count() const { return dims_.empty() ? 0 : dims_[0]; }
+
+        /// Amount of elements per record.
+        size_t record_size() const { return record_size_; }
+
+        /// All elements of all records.
+        template<typename T>
+        span<T> elements() const {
+            check<T>();
+            return { data_, count() * record_size_ };
+        }
+
+        /// The elements of record i.
+        template<typename T>
+        span<T> record(size_t i) const {
+            if (i >= count())
+                throw std::out_of_range("IDX record index out of range");
+            check<T>();
+            return { data_ + i * record_size_ * sizeof(T), record_size_ };
+        }
+
+    private:
+        template<typename T>
+        void check() const {
+            static_assert(is_element<T>, "not an IDX element type");
+            if (type_of<T> != t)
+                throw std::runtime_error("IDX element type mismatch");
+        }
+    };
+
+    /**
+     * \brief Open a label file (one ubyte per record).
+     */
+    template<typename = void> /* hush */
+    file read_idx1(std::string_view filename) {
+        file f(filename);
+        if (f.dims().size() != 1 || f.type() != type::ubyte)
+            throw std::runtime_error("not an IDX1 ubyte file");
+
+        std::cout << "records: " << f.count() << "\n";
+        return f;
+    }
+
+    /**
+     * \brief Open an image file (Rows x Cols ubytes per record).
+     */
+    template<uint Rows, uint Cols>
+    file read_idx3(std::string_view filename) {
+        file f(filename);
+        if (f.dims().size() != 3 || f.type() != type::ubyte)
+            throw std::runtime_error("not an IDX3 ubyte file");
+
+        std::cout << "records: " << f.count() << "\n";
+        if (f.dims()[1] != Rows || f.dims()[2] != Cols)
+            throw std::runtime_error("image dims do not match");
+
+        return f;
+    }
+}
@@ -0,0 +1,205 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief Background batch preparation.
+ *
+ * A batch_loader owns a producer thread that turns IDX records into
+ * input and one-hot output matrices, a few batches ahead of the
+ * training loop. The order of the records comes from a sampler.
+ */
+
+#include "common.hh"
+#include "matrix.hh"
+#include "idx_file.hh"
+#include "sampler.hh"
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace idx {
+
+    /**
+     * \brief Prepares batches of (image, label) records on a separate thread.
+     *
+     * Up to `depth` batches are in flight: the one returned by the last
+     * call to next(), and depth-1 that are being (or have been) filled.
+     *
+     * \tparam T      Matrix element type.
+     * \tparam depth  Amount of batch buffers (2: double, 3: triple buffering).
+     */
+    template<typename T, uint batch_size, uint inputs, uint outputs, uint depth = 3>
+    class batch_loader {
+        static_assert(depth >= 2, "Need at least two buffers to prefetch anything");
+
+    public:
+        struct batch {
+            Matrix<T,batch_size,inputs>  X;
+            Matrix<T,batch_size,outputs> Y;
+        };
+
+    private:
+        const file *images;
+        const file *labels;
+
+        idx::sampler sampler;
+
+        size_t per_epoch;
+        size_t total;
+
+        // Batches are big: keep them on the heap, and reuse them.
+        std::unique_ptr<batch> slots[depth];
+
+        std::mutex              mutex;
+        std::condition_variable ready; // Producer -> consumer.
+        std::condition_variable freed; // Consumer -> producer.
+
+        size_t produced = 0; ///< Batches filled.
+        size_t taken    = 0; ///< Batches handed out by next().
+        size_t released = 0; ///< Batches given back.
+        bool   stopping = false;
+
+        std::exception_ptr error;
+
+        std::thread producer;
+
+        void fill(batch &b, const uint32_t *records) const {
+            auto label = labels->elements<uint8_t>();
+            T *x = b.X.data();
+            T *y = b.Y.data();
+
+            std::fill(y, y + size_t(batch_size) * outputs, T(0));
+
+            for (uint k = 0; k < batch_size; ++k) {
+                auto image = images->record<uint8_t>(records[k]);
+                for (uint l = 0; l < inputs; ++l)
+                    x[size_t(k) * inputs + l] = (T)image[l] / 255;
+
+                uint c = label[records[k]];
+                if (c >= outputs)
+                    throw std::runtime_error("label out of range");
+                y[size_t(k) * outputs + c] = 1;
+            }
+        }
+
+        void produce() {
+            try {
+                std::vector<uint32_t> order;
+
+                for (size_t n = 0; n < total; ++n) {
+                    if (n % per_epoch == 0)
+                        sampler.epoch(n / per_epoch, order);
+
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        freed.wait(lock, [&] { return stopping || produced - released < depth; });
+                        if (stopping)
+                            return;
+                    }
+
+                    // This slot is ours until it is published below.
+                    fill(*slots[n % depth], &order[n % per_epoch * batch_size]);
+
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        ++produced;
+                    }
+                    ready.notify_one();
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                error = std::current_exception();
+                ready.notify_one();
+            }
+        }
+
+    public:
+        /**
+         * \param images  Image file, one record per input row.
+         * \param labels  Label file, one class number per record.
+         * \param epochs  Amount of passes over the data set.
+         * \param order   The order to visit records in, see sampler.hh.
+         * \param seed    Seed for the sampler.
+         *
+         * Trailing records that do not fill a whole batch are skipped.
+         * Both files must outlive the loader.
+         */
+        batch_loader(const file &images,
+                     const file &labels,
+                     uint epochs = 1,
+                     sampling order = sampling::sequential,
+                     uint64_t seed = 0)
+            : images(&images),
+              labels(&labels),
+              sampler(labels, order, seed),
+              per_epoch(sampler.size() / batch_size),
+              total(per_epoch * epochs) {
+
+            if (images.record_size() != inputs)
+                throw std::runtime_error("image size does not match input layer size");
+            if (images.count() < labels.count())
+                throw std::runtime_error("less images than labels");
+
+            for (auto &s : slots)
+                s = std::make_unique<batch>();
+
+            if (total)
+                producer = std::thread([this] { produce(); });
+        }
+
+        ~batch_loader() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            freed.notify_one();
+            if (producer.joinable())
+                producer.join();
+        }
+
+        batch_loader(const batch_loader&) = delete;
+        batch_loader &operator=(const batch_loader&) = delete;
+
+        size_t batches_per_epoch() const { return per_epoch; }
+        size_t batches()           const { return total;     }
+
+        /**
+         * \brief Wait for the next batch.
+         *
+         * The returned batch stays valid until the next call.
+         * Must be called at most batches() times.
+         */
+        const batch &next() {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (taken > released) {
+                ++released;
+                freed.notify_one();
+            }
+            ready.wait(lock, [&] { return error || produced > taken; });
+            if (error)
+                std::rethrow_exception(error);
+
+            return *slots[taken++ % depth];
+        }
+    };
+}
@@ -18,20 +18,167 @@
 #include "matrix.hh"
 #include "nn.hh"
 #include "idx.hh"
+#include "server.hh"
+#include "codegen.hh"
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 
-void run_mnist() {
-    auto result = idx::run<28,28,10,100,4,30>("../../mnist/train-images.idx3-ubyte",
-                                              "../../mnist/train-labels.idx1-ubyte",
-                                              "../../mnist/t10k-images.idx3-ubyte",
-                                              "../../mnist/t10k-labels.idx1-ubyte",
-                                              4);
+// The net that run_mnist() trains and checkpoints.
+using mnist_net = decltype(nn::make_net<float,28*28,10,4,30>());
+constexpr uint mnist_batch_size = 100;
+using mnist_output = nn::softmax_cross_entropy;
+
+void run_mnist(uint64_t seed) {
+    auto result = idx::run<28,28,10,mnist_batch_size,4,30,4,float,float,mnist_output>("../../mnist/train-images.idx3-ubyte",
+                                                                                      "../../mnist/train-labels.idx1-ubyte",
+                                                                                      "../../mnist/t10k-images.idx3-ubyte",
+                                                                                      "../../mnist/t10k-labels.idx1-ubyte",
+                                                                                      4,
+                                                                                      seed,
+                                                                                      idx::sampling::shuffle,
+                                                                                      0,
+                                                                                      "mnist.ckpt",
+                                                                                      optim::adam { },
+                                                                                      optim::constant { 0.003 });
+
+    idx::quantization_report<mnist_batch_size, mnist_output>(result.net,
+                                                             "../../mnist/t10k-images.idx3-ubyte",
+                                                             "../../mnist/t10k-labels.idx1-ubyte");
+}
+
+// A net with a convolution layer in front, see conv.hh.
+using mnist_conv_net = nn::make_conv_net<float, nn::image<28,28,1>,
+                                         nn::list<nn::conv<5,8,nn::max_pool<2>>>,
+                                         10, 1, 64>;
+
+void run_mnist_conv(uint64_t seed) {
+    idx::run_net<mnist_conv_net,28,28,mnist_batch_size,4,float,mnist_output>("../../mnist/train-images.idx3-ubyte",
+                                                                            "../../mnist/train-labels.idx1-ubyte",
+                                                                            "../../mnist/t10k-images.idx3-ubyte",
+                                                                            "../../mnist/t10k-labels.idx1-ubyte",
+                                                                            4,
+                                                                            seed,
+                                                                            idx::sampling::shuffle,
+                                                                            0,
+                                                                            "mnist-conv.ckpt",
+                                                                            optim::adam { },
+                                                                            optim::constant { 0.003 });
+}
+
+/**
+ * \brief Train and test a net for every shape in `shapes`, written as
+ *        "<hidden layers>x<neurons per layer>".
+ *
+ * The shapes compiled in below get a static net, others a net shaped at
+ * run time (see dynamic.hh).
+ */
+void sweep_mnist(uint64_t seed, const std::vector<std::string> &shapes) {
+    std::vector<idx::Score> scores;
+    for (const auto &shape : shapes) {
+        uint layers, neurons;
+        if (std::sscanf(shape.c_str(), "%ux%u", &layers, &neurons) != 2)
+            throw std::invalid_argument("Expected <hidden layers>x<neurons per layer>, not " + shape);
+
+        std::cout << "shape " << shape << "\n";
+        scores.push_back(idx::sweep<28,28,10,mnist_batch_size,float,mnist_output,
+                                    dyn::static_shape<28*28,10,4,30>,
+                                    dyn::static_shape<28*28,10,1,30>>(layers, neurons,
+                                                                      "../../mnist/train-images.idx3-ubyte",
+                                                                      "../../mnist/train-labels.idx1-ubyte",
+                                                                      "../../mnist/t10k-images.idx3-ubyte",
+                                                                      "../../mnist/t10k-labels.idx1-ubyte",
+                                                                      4,
+                                                                      seed,
+                                                                      idx::sampling::shuffle,
+                                                                      0.01));
+    }
+
+    for (size_t i = 0; i < shapes.size(); ++i)
+        std::cout << shapes[i] << ": " << scores[i].correct << "/" << scores[i].total
+                  << " correct, loss " << scores[i].loss << "\n";
+}
+
+namespace {
+    std::atomic<bool> stopping { false };
+
+    void stop(int) { stopping = true; }
 }
 
-int main() {
-    srand(time(NULL));
+/**
+ * \brief Answer requests with the net saved by run_mnist().
+ *
+ * Reads requests from stdin, or from clients of a Unix socket if a path
+ * is given. See server.hh for the protocol.
+ */
+void serve_mnist(const char *socket_path, long max_wait_us) {
+    checkpoint::mapped<mnist_net> ckpt("mnist.ckpt");
+    serve::batcher<mnist_batch_size, std::decay_t<decltype(ckpt.net())>, mnist_output>
+        batcher(ckpt.net(), std::chrono::microseconds(max_wait_us));
+
+    std::signal(SIGPIPE, SIG_IGN);
+    if (socket_path) {
+        std::signal(SIGINT,  stop);
+        std::signal(SIGTERM, stop);
+        std::cerr << "listening on " << socket_path << "\n";
+        serve::serve_unix(batcher, socket_path, stopping);
+    } else {
+        serve::serve_stream(batcher, STDIN_FILENO, STDOUT_FILENO);
+    }
+    batcher.stats().report(std::cerr);
+}
+
+/**
+ * \brief Write the net saved by run_mnist() as a standalone header, see
+ *        codegen.hh.
+ */
+void codegen_mnist(const char *header, const char *name) {
+    checkpoint::mapped<mnist_net> ckpt("mnist.ckpt");
+
+    std::ofstream file(header);
+    if (!file)
+        throw std::runtime_error(std::string("Could not open ") + header);
+
+    codegen::options opt;
+    opt.name   = name;
+    opt.source = "mnist.ckpt";
+    codegen::emit<mnist_output>(file, ckpt.net(), opt);
+}
+
+int main(int argc, char **argv) {
+    // nn serve [socket path [max wait in us]]
+    if (argc > 1 && !std::strcmp(argv[1], "serve")) {
+        serve_mnist(argc > 2 && *argv[2] ? argv[2] : nullptr,
+                    argc > 3 ? std::stol(argv[3]) : 1000);
+        return 0;
+    }
+
+    // nn codegen [header [namespace]]
+    if (argc > 1 && !std::strcmp(argv[1], "codegen")) {
+        codegen_mnist(argc > 2 ? argv[2] : "mnist_net.hh",
+                      argc > 3 ? argv[3] : "mnist");
+        return 0;
+    }
+
+    // nn sweep <shape>...
+    bool sweep = argc > 1 && !std::strcmp(argv[1], "sweep");
+    // nn conv [seed]
+    bool conv  = argc > 1 && !std::strcmp(argv[1], "conv");
+
+    // Pass the seed of an earlier run to reproduce it.
+    uint64_t seed = conv  ? (argc > 2 ? std::stoull(argv[2]) : time(NULL))
+                  : argc > 1 && !sweep ? std::stoull(argv[1]) : time(NULL);
+    std::cout << "seed: " << seed << "\n";
     std::cout.precision(2);
 
-    run_mnist();
+    if (sweep)
+        sweep_mnist(seed, std::vector<std::string>(argv + 2, argv + argc));
+    else if (conv)
+        run_mnist_conv(seed);
+    else
+        run_mnist(seed);
 
     return 0;
 }
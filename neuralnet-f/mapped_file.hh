@@ -0,0 +1,96 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * \brief A read-only memory mapping of a whole file.
+ *
+ * Pages are loaded on first access and are shared with every other
+ * process that maps the same file.
+ */
+class mapped_file {
+    const unsigned char *p = nullptr;
+    size_t               n = 0;
+
+    void unmap() {
+        if (p)
+            ::munmap(const_cast<unsigned char*>(p), n);
+        p = nullptr;
+        n = 0;
+    }
+
+public:
+    const unsigned char *data() const { return p; }
+    size_t               size() const { return n; }
+
+    mapped_file() = default;
+
+    explicit mapped_file(std::string_view filename) {
+        int fd = ::open(std::string(filename).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error("Could not open " + std::string(filename));
+
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            ::close(fd);
+            throw std::runtime_error("Could not stat " + std::string(filename));
+        }
+        n = st.st_size;
+
+        // Empty files cannot be mapped; they simply have no data.
+        if (n) {
+            void *m = ::mmap(nullptr, n, PROT_READ, MAP_SHARED, fd, 0);
+            if (m == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Could not map " + std::string(filename));
+            }
+            p = static_cast<const unsigned char*>(m);
+        }
+        // The mapping stays valid without the descriptor.
+        ::close(fd);
+    }
+
+    mapped_file(mapped_file &&o)
+        : p(std::exchange(o.p, nullptr)),
+          n(std::exchange(o.n, 0))
+        { }
+
+    mapped_file &operator=(mapped_file &&o) {
+        if (this != &o) {
+            unmap();
+            p = std::exchange(o.p, nullptr);
+            n = std::exchange(o.n, 0);
+        }
+        return *this;
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file &operator=(const mapped_file&) = delete;
+
+    ~mapped_file() { unmap(); }
+};
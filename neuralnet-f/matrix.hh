@@ -30,37 +30,131 @@
 #include <cstdint>
 #include <cmath>
 #include <type_traits>
+#include <algorithm>
+#include <new>
+
+#include "gemm.hh"
+#include "half.hh"
+#include "simd.hh"
+#include "expr.hh"
 
 #ifdef NDEBUG
 #define MATRIX_NDEBUG 1
 #endif
 
+#ifndef MATRIX_HEAP_THRESHOLD
+/// Matrices bigger than this (in bytes) keep their elements on the heap.
+#define MATRIX_HEAP_THRESHOLD 32768
+#endif
+
+namespace matrix_detail {
+
+    /**
+     * \brief Element storage for a Matrix.
+     *
+     * Small matrices keep their elements inline (and stay usable in
+     * constant expressions), big ones get a 64-byte aligned heap block so
+     * that they can live on the stack and be moved around cheaply.
+     */
+    template<typename T1, size_t N,
+             bool heap = (N * sizeof(T1) > MATRIX_HEAP_THRESHOLD)>
+    class storage {
+        T1 elems[N] { };
+
+    public:
+        constexpr const T1 *data() const { return elems; }
+        constexpr       T1 *data()       { return elems; }
+
+        constexpr storage() = default;
+        constexpr storage(uninitialized_t) { }
+    };
+
+    template<typename T1, size_t N>
+    class storage<T1,N,true> {
+        static constexpr std::align_val_t alignment { 64 };
+
+        T1 *elems;
+
+        static T1 *allocate() {
+            return static_cast<T1*>(::operator new(N * sizeof(T1), alignment));
+        }
+
+    public:
+        const T1 *data() const { return elems; }
+              T1 *data()       { return elems; }
+
+        storage()
+            : elems(allocate())
+            { std::fill(elems, elems + N, T1 { }); }
+
+        storage(uninitialized_t)
+            : elems(allocate())
+            { }
+
+        storage(const storage &o)
+            : elems(allocate())
+            { std::copy(o.elems, o.elems + N, elems); }
+
+        storage(storage &&o) noexcept
+            : elems(o.elems)
+            { o.elems = nullptr; }
+
+        storage &operator=(const storage &o) {
+            if (!elems)
+                elems = allocate();
+            if (this != &o)
+                std::copy(o.elems, o.elems + N, elems);
+            return *this;
+        }
+
+        storage &operator=(storage &&o) noexcept {
+            std::swap(elems, o.elems);
+            return *this;
+        }
+
+        ~storage() {
+            if (elems)
+                ::operator delete(elems, alignment);
+        }
+    };
+}
+
 template<typename T1, uint rows, uint cols>
 class Matrix {
-    static_assert(std::is_arithmetic<T1>::value,
-                  "Matrix type must be arithmetic");
+    static_assert(std::is_arithmetic<T1>::value || half::is_half<T1>::value,
+                  "Matrix type must be arithmetic (or a 16-bit storage type)");
     static_assert(rows >= 1 && cols >= 1,
                   "A Matrix must have a positive non-zero amount of rows and columns");
 protected:
-    T1 elems[rows][cols] { };
+    matrix_detail::storage<T1, size_t(rows) * cols> elems;
 
 public:
+    using value_type = T1;
+
     constexpr static uint nrows = rows;
     constexpr static uint ncols = cols;
 
+    /**
+     * \brief Raw access to the (row-major) elements.
+     */
+    constexpr const T1 *data() const { return elems.data(); }
+    constexpr       T1 *data()       { return elems.data(); }
+
+    constexpr static size_t size() { return size_t(rows) * cols; }
+
     constexpr const T1 &operator()(uint row, uint col) const {
         #ifndef MATRIX_NDEBUG
         if (!row || !col || row > rows || col > cols)
             throw std::logic_error("Matrix index out of bounds");
         #endif
-        return elems[row-1][col-1];
+        return data()[(row-1) * cols + (col-1)];
     }
     constexpr T1 &operator()(uint row, uint col) {
         #ifndef MATRIX_NDEBUG
         if (!row || !col || row > rows || col > cols)
             throw std::logic_error("Matrix index out of bounds");
         #endif
-        return elems[row-1][col-1];
+        return data()[(row-1) * cols + (col-1)];
     }
 
     constexpr Matrix<T1,1,cols> operator()(uint row) const {
@@ -74,130 +168,57 @@ public:
         return m;
     }
 
-    /**
-     * \brief Negate matrices.
-     */
-    constexpr Matrix<T1, rows, cols> operator-() const {
-        Matrix<T1, rows, cols> c;
-
-        for (uint row = 1; row <= rows; row++) {
-            for (uint col = 1; col <= cols; col++)
-                c(row, col) = -this->operator()(row, col);
-        }
-
-        return c;
-    }
-
     /**
      * \brief Transpose matrices.
+     *
+     * This returns a view; it is copied only when it is used in an
+     * element-wise operation or assigned to a Matrix.
      */
-    constexpr Matrix<T1, cols, rows> T() const {
-        Matrix<T1, cols, rows> c;
-
-        for (uint row = 1; row <= rows; row++) {
-            for (uint col = 1; col <= cols; col++)
-                c(col, row) = this->operator()(row, col);
-        }
-
-        return c;
+    constexpr auto T() const & {
+        using namespace matrix_expr;
+        return transposed<ref<Matrix>>(ref<Matrix> { this });
     }
-
-    /**
-     * \brief Multiply a matrix with a scalar.
-     */
-    constexpr Matrix<T1, rows, cols> operator*(T1 n) const {
-        Matrix<T1, rows, cols> c;
-
-        for (uint row = 1; row <= rows; row++) {
-            for (uint col = 1; col <= cols; col++) {
-                c(row, col) = this->operator()(row, col) * n;
-            }
-        }
-
-        return c;
+    constexpr auto T() && {
+        using namespace matrix_expr;
+        return transposed<own<Matrix>>(own<Matrix> { std::move(*this) });
     }
+
     /**
      * \brief Multiply a matrix with a scalar. Assign the result.
      */
-    Matrix<T1, rows, cols> &operator*=(T1 n) {
-        for (uint row = 1; row <= rows; row++) {
-            for (uint col = 1; col <= cols; col++)
-                this->operator()(row, col) *= n;
-        }
-
+    constexpr Matrix<T1, rows, cols> &operator*=(T1 n) {
+        simd::transform(size(), data(),
+                        simd::vectorized([n](auto a) { return a * n; }),
+                        data());
         return *this;
     }
 
-    /**
-     * \brief Add matrices.
-     */
-    constexpr Matrix<T1, rows, cols> operator+(Matrix<T1, rows, cols> b) const {
-        Matrix<T1, rows, cols> c;
-
-        for (uint row = 1; row <= rows; row++) {
-            for (uint col = 1; col <= cols; col++)
-                c(row, col) = this->operator()(row, col) + b(row, col);
-        }
-
-        return c;
-    }
-
     /**
      * \brief Add matrices. Assign the result
+     *
+     * Products are accumulated directly into this matrix.
      */
-    Matrix<T1, rows, cols> &operator+=(Matrix<T1, rows, cols> b) {
-        for (uint row = 1; row <= rows; row++) {
-            for (uint col = 1; col <= cols; col++)
-                this->operator()(row, col) += b(row, col);
-        }
-
-        return *this;
-    }
-
-    /**
-     * \brief Subtract matrices.
-     */
-    constexpr Matrix<T1, rows, cols> operator-(Matrix<T1, rows, cols> b) const {
-        // Perhaps I'm being a bit too lazy.
-        return this->operator+(-b);
+    template<typename E,
+             typename = std::enable_if_t<matrix_expr::is_operand<std::decay_t<E>>>>
+    constexpr Matrix<T1, rows, cols> &operator+=(E &&e) {
+        return accumulate(std::forward<E>(e), 1);
     }
 
     /**
      * \brief Subtract matrices. Assign the result.
      */
-    Matrix<T1, rows, cols> &operator-=(Matrix<T1, rows, cols> b) {
-        return this->operator+=(-b);
+    template<typename E,
+             typename = std::enable_if_t<matrix_expr::is_operand<std::decay_t<E>>>>
+    constexpr Matrix<T1, rows, cols> &operator-=(E &&e) {
+        return accumulate(std::forward<E>(e), -1);
     }
 
     /**
      * \brief Dot product.
      */
     template<uint bCols>
-    constexpr Matrix<T1, rows, bCols> dot(const Matrix<T1, cols, bCols> &b) const {
-
-        Matrix<T1, rows, bCols> c;
-
-        for (uint cRow = 1; cRow <= rows; cRow++) {
-            for (uint cCol = 1; cCol <= bCols; cCol++) {
-                T1 sum = 0;
-                for (uint i = 1; i <= cols; i++)
-                    sum += this->operator()(cRow, i) * b(i, cCol);
-                c(cRow, cCol) = sum;
-            }
-        }
-
-        return c;
-    }
-
-    /**
-     * \brief Multiply matrices with each other.
-     */
-    constexpr Matrix<T1, rows, cols> operator*(const Matrix<T1, rows, cols> &b) const {
-        Matrix<T1, rows, cols> m;
-        for (uint r = 1; r <= rows; ++r)
-            for (uint c = 1; c <= cols; ++c)
-                m(r,c) = (*this)(r,c) * b(r,c);
-        return m;
+    constexpr auto dot(const Matrix<T1, cols, bCols> &b) const {
+        return matrix_expr::make_product(*this, b);
     }
 
     /**
@@ -206,9 +227,11 @@ public:
      * This is only valid for square matrices.
      */
     //typename std::enable_if<(rows==cols),Matrix<T1,rows,rows>>::type *
-    Matrix<T1,rows,cols> &operator*=(const Matrix<T1,cols,rows> &b) {
+    constexpr Matrix<T1,rows,cols> &operator*=(const Matrix<T1,cols,rows> &b) {
         static_assert(rows == cols, "Cannot assign non-square matrix multiplication result");
-        *this = this->operator*(b);
+        matrix_expr::evaluate(matrix_expr::make_node(simd::vectorized([](auto x, auto y) { return x * y; }),
+                                                     *this, b),
+                              data());
         return *this;
     }
 
@@ -223,29 +246,27 @@ public:
         return b;
     }
 
+    /**
+     * \brief Apply f to every element.
+     *
+     * If f is wrapped in simd::vectorized, it is applied to whole vectors
+     * of elements at once.
+     *
+     * The result is lazy (see expr.hh).
+     */
     template<typename F>
-    constexpr auto map(const F &f) const {
-
-        Matrix<T1, rows, cols> b;
-
-        for (uint r = 1; r <= rows; ++r)
-            for (uint c = 1; c <= cols; ++c)
-                b(r,c) = f(this->operator()(r, c));
-
-        return b;
+    constexpr auto map(const F &f) const & {
+        return matrix_expr::make_node(f, *this);
+    }
+    template<typename F>
+    constexpr auto map(const F &f) && {
+        return matrix_expr::make_node(f, std::move(*this));
     }
 
     template<typename F>
     constexpr auto &mip(const F &f) {
         // Map In Place.
-
-        for (uint r = 1; r <= rows; ++r) {
-            for (uint c = 1; c <= cols; ++c) {
-                auto &x = this->operator()(r, c);
-                x = f(x);
-            }
-        }
-
+        simd::transform(size(), data(), f, data());
         return *this;
     }
 
@@ -263,6 +284,24 @@ public:
 
     constexpr Matrix() = default;
 
+    /**
+     * \brief Create a matrix whose elements will be overwritten right away.
+     *
+     * Small matrices are zeroed anyway, big ones are left uninitialized.
+     */
+    constexpr explicit Matrix(matrix_detail::uninitialized_t)
+        : elems(matrix_detail::uninitialized)
+        { }
+
+    /**
+     * \brief Evaluate a matrix expression.
+     */
+    template<typename E,
+             typename = std::enable_if_t<matrix_expr::is_expr<std::decay_t<E>>>>
+    constexpr Matrix(E &&e)
+        : Matrix(std::forward<E>(e).eval())
+        { }
+
     constexpr Matrix(std::initializer_list<T1> il) {
         #ifndef MATRIX_NDEBUG
         if (il.size() != rows * cols)
@@ -281,31 +320,234 @@ public:
         }
     }
 
-    Matrix<T1, rows, cols> &operator=(const Matrix<T1, rows, cols> &b) {
-        for (uint row = 1; row <= rows; row++) {
-            for (uint col = 1; col <= cols; col++)
-                this->operator()(row, col) = b(row, col);
+    constexpr Matrix(const Matrix<T1, rows, cols> &) = default;
+    constexpr Matrix(Matrix<T1, rows, cols> &&)      = default;
+
+    constexpr Matrix<T1, rows, cols> &operator=(const Matrix<T1, rows, cols> &) = default;
+    constexpr Matrix<T1, rows, cols> &operator=(Matrix<T1, rows, cols> &&)      = default;
+
+    /**
+     * \brief Evaluate a matrix expression, straight into this matrix.
+     */
+    template<typename E,
+             typename = std::enable_if_t<matrix_expr::is_expr<std::decay_t<E>>>>
+    constexpr Matrix<T1, rows, cols> &operator=(E &&e) {
+        using D = std::decay_t<E>;
+        static_assert(std::is_same<typename D::matrix_type, Matrix>::value,
+                      "Cannot assign a matrix expression of different dimensions");
+
+        if constexpr (matrix_expr::is_product<D>::value) {
+            if (e.aliases(data()))
+                *this = e.eval();
+            else
+                e.eval_into(data(), false);
+        } else if constexpr (matrix_expr::is_node<D>::value) {
+            // Element-wise evaluation is safe even if e refers to us.
+            matrix_expr::evaluate(e, data());
+        } else {
+            *this = e.eval();
+        }
+        return *this;
+    }
+
+private:
+    template<typename E>
+    constexpr Matrix<T1, rows, cols> &accumulate(E &&e, T1 sign) {
+        using D = std::decay_t<E>;
+        if constexpr (matrix_expr::is_product<D>::value) {
+            if (e.aliases(data()))
+                return accumulate(e.eval(), sign);
+            e.scaled(sign).eval_into(data(), true);
+        } else {
+            matrix_expr::evaluate(matrix_expr::make_node(simd::vectorized([sign](auto x, auto y) {
+                                                             return x + sign * y;
+                                                         }),
+                                                         *this, std::forward<E>(e)),
+                                  data());
         }
         return *this;
     }
 
+public:
+
     ~Matrix() = default;
 };
 
+/**
+ * \brief A read-only view on row-major elements owned by someone else.
+ *
+ * A view can be used anywhere a const Matrix can be used in an
+ * expression, without copying its elements. The elements must outlive
+ * the view and every expression that refers to it.
+ */
+template<typename T1, uint rows, uint cols>
+class MatrixView {
+    static_assert(std::is_arithmetic<T1>::value || half::is_half<T1>::value,
+                  "Matrix type must be arithmetic (or a 16-bit storage type)");
+
+    const T1 *p;
+
+public:
+    using value_type  = T1;
+    using matrix_type = Matrix<T1, rows, cols>;
+
+    constexpr static uint nrows = rows;
+    constexpr static uint ncols = cols;
+    constexpr static bool vectorized = true;
+
+    constexpr explicit MatrixView(const T1 *p) : p(p) { }
+    constexpr MatrixView(const Matrix<T1, rows, cols> &m) : p(m.data()) { }
+
+    constexpr const T1 *data() const { return p; }
+    constexpr static size_t size() { return size_t(rows) * cols; }
+
+    constexpr const T1 &operator()(uint row, uint col) const {
+        #ifndef MATRIX_NDEBUG
+        if (!row || !col || row > rows || col > cols)
+            throw std::logic_error("Matrix index out of bounds");
+        #endif
+        return p[(row-1) * cols + (col-1)];
+    }
+
+    // Expression leaf interface (see expr.hh).
+    constexpr const MatrixView &get() const { return *this; }
+
+    constexpr gemm::operand<T1> operand() const { return { p, cols, 1 }; }
+
+    template<typename V>
+    constexpr V packet(size_t i) const { return matrix_expr::load<V>(p, i); }
+
+    constexpr matrix_type eval() const {
+        matrix_type m(matrix_detail::uninitialized);
+        for (size_t i = 0; i < size(); ++i)
+            m.data()[i] = p[i];
+        return m;
+    }
+
+    constexpr auto T() const {
+        return matrix_expr::transposed<MatrixView>(*this);
+    }
+
+    template<uint bCols>
+    constexpr auto dot(const Matrix<T1, cols, bCols> &b) const {
+        return matrix_expr::make_product(*this, b);
+    }
+
+    template<typename F>
+    constexpr auto map(const F &f) const {
+        return matrix_expr::make_node(f, *this);
+    }
+};
+
 template<uint rows, uint cols>
 using Matrixf = Matrix<float, rows, cols>;
 
 template<uint rows, uint cols>
 using Matrixd = Matrix<double, rows, cols>;
 
-template<typename M1, typename M2>
-constexpr auto dot(const M1 &a, const M2 &b) {
-    return a.dot(b);
+/**
+ * \brief Convert the elements of a matrix to another type.
+ *
+ * E.g. to store weights as half::bf16 for inference.
+ */
+template<typename T2, typename M>
+auto matrix_cast(const M &m) {
+    Matrix<T2, M::nrows, M::ncols> r(matrix_detail::uninitialized);
+    std::transform(m.data(), m.data() + m.size(), r.data(),
+                   [](auto x) { return T2(x); });
+    return r;
 }
 
-template<typename T1, uint rows, uint cols>
-constexpr auto operator*(T1 a, const Matrix<T1,rows,cols> &m) {
-    return m * a;
+/**
+ * \brief Dot product.
+ *
+ * Either operand may be a transposed view.
+ */
+template<typename M1, typename M2,
+         typename = std::enable_if_t<matrix_expr::is_operand<std::decay_t<M1>>
+                                     && matrix_expr::is_operand<std::decay_t<M2>>>>
+constexpr auto dot(M1 &&a, M2 &&b) {
+    return matrix_expr::make_product(std::forward<M1>(a), std::forward<M2>(b));
+}
+
+/**
+ * \brief Evaluate a matrix expression.
+ */
+template<typename E,
+         typename = std::enable_if_t<matrix_expr::is_operand<std::decay_t<E>>>>
+constexpr auto eval(E &&e) {
+    using D = std::decay_t<E>;
+    if constexpr (matrix_expr::is_matrix<D>::value)
+        return D(std::forward<E>(e));
+    else
+        return std::forward<E>(e).eval();
+}
+
+/**
+ * \brief Negate matrices.
+ */
+template<typename A,
+         typename = std::enable_if_t<matrix_expr::is_operand<std::decay_t<A>>>>
+constexpr auto operator-(A &&a) {
+    if constexpr (matrix_expr::is_product<std::decay_t<A>>::value)
+        return a.scaled(-1);
+    else
+        return matrix_expr::make_node(simd::vectorized([](auto x) { return -x; }),
+                                      std::forward<A>(a));
+}
+
+/**
+ * \brief Add matrices.
+ */
+template<typename A, typename B,
+         typename = std::enable_if_t<matrix_expr::is_operand<std::decay_t<A>>
+                                     && matrix_expr::is_operand<std::decay_t<B>>>>
+constexpr auto operator+(A &&a, B &&b) {
+    return matrix_expr::make_node(simd::vectorized([](auto x, auto y) { return x + y; }),
+                                  std::forward<A>(a), std::forward<B>(b));
+}
+
+/**
+ * \brief Subtract matrices.
+ */
+template<typename A, typename B,
+         typename = std::enable_if_t<matrix_expr::is_operand<std::decay_t<A>>
+                                     && matrix_expr::is_operand<std::decay_t<B>>>>
+constexpr auto operator-(A &&a, B &&b) {
+    return matrix_expr::make_node(simd::vectorized([](auto x, auto y) { return x - y; }),
+                                  std::forward<A>(a), std::forward<B>(b));
+}
+
+/**
+ * \brief Multiply matrices with each other (element-wise).
+ */
+template<typename A, typename B,
+         typename = std::enable_if_t<matrix_expr::is_operand<std::decay_t<A>>
+                                     && matrix_expr::is_operand<std::decay_t<B>>>>
+constexpr auto operator*(A &&a, B &&b) {
+    return matrix_expr::make_node(simd::vectorized([](auto x, auto y) { return x * y; }),
+                                  std::forward<A>(a), std::forward<B>(b));
+}
+
+/**
+ * \brief Multiply a matrix with a scalar.
+ *
+ * Scaling a product only changes its coefficient.
+ */
+template<typename A,
+         typename = std::enable_if_t<matrix_expr::is_operand<std::decay_t<A>>>>
+constexpr auto operator*(A &&a, typename std::decay_t<A>::value_type n) {
+    if constexpr (matrix_expr::is_product<std::decay_t<A>>::value)
+        return a.scaled(n);
+    else
+        return matrix_expr::make_node(simd::vectorized([n](auto x) { return x * n; }),
+                                      std::forward<A>(a));
+}
+
+template<typename A,
+         typename = std::enable_if_t<matrix_expr::is_operand<std::decay_t<A>>>>
+constexpr auto operator*(typename std::decay_t<A>::value_type n, A &&a) {
+    return std::forward<A>(a) * n;
 }
 
 
@@ -346,4 +588,10 @@ std::ostream &operator<<(std::ostream &stream, const Matrix<T1, rows, cols> &m)
     return stream;
 }
 
+template<typename E,
+         typename = std::enable_if_t<matrix_expr::is_expr<std::decay_t<E>>>>
+std::ostream &operator<<(std::ostream &stream, const E &e) {
+    return stream << e.eval();
+}
+
 #endif /* MATRIX_WANT_STREAMOPS */
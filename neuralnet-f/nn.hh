@@ -18,15 +18,20 @@
 
 #include "common.hh"
 #include "matrix.hh"
+#include <algorithm>
+#include <cmath>
 #include <tuple>
+#include <type_traits>
+#include <utility>
 
 namespace nn {
 
     // Activation functions. {{{
 
-    constexpr auto sigma  = [](auto ws) { return 1 / (1 + exp(-ws)); };
+    // These work on scalars as well as on SIMD vectors (see simd.hh).
+    constexpr auto sigma  = simd::vectorized([](auto ws) { return 1 / (1 + simd::exp(-ws)); });
     // Input for sigma' is an activation value (the sigma of the weighted sum of inputs).
-    constexpr auto sigma_ = [](auto a)  { return a * (1 - a);        };
+    constexpr auto sigma_ = simd::vectorized([](auto a)  { return a * (1 - a);              });
 
     constexpr auto relu  = [](auto ws) { return ws <= 0 ? 0 : ws; };
     constexpr auto relu_ = [](auto a)  { return a  <= 0 ? 0 : 1;  };
@@ -45,6 +50,15 @@ namespace nn {
     template<typename...>
     struct list {};
 
+    /**
+     * \brief Position of a weight matrix or bias vector in the net tuple,
+     *        counting from the input layer.
+     *
+     * Layer n has its weights at 2n and its biases at 2n+1.
+     */
+    template<uint I>
+    using layer_index = std::integral_constant<uint,I>;
+
     // The machine spirits are willing.
 
     namespace detail {
@@ -74,34 +88,145 @@ namespace nn {
     template<template<typename...> typename C, typename X, uint I>
     using repeat = typename detail::repeat<C,list<>,X,I>::type;
 
+    namespace detail {
+
+        /**
+         * \brief Evaluate the deltas of a layer, and sum them over the batch
+         *        (the delta of its biases) in the same pass.
+         */
+        template<typename E, typename DBT>
+        constexpr auto eval_delta(const E &e, DBT &dB) {
+            typename E::matrix_type D(matrix_detail::uninitialized);
+            for (size_t i = 0; i < dB.size(); ++i)
+                dB.data()[i] = 0;
+            matrix_expr::evaluate_colsum(e, D.data(), dB.data());
+            return D;
+        }
+    }
+
+    // Kinds of layers. {{{
+
+    /*
+     * What a layer computes depends on the type of its weights
+     * (layer_traits) and, when training, on the type of the activations
+     * it keeps for backpropagation (activation_traits). The primary
+     * templates are fully connected layers; conv.hh adds convolutions.
+     */
+
+    /**
+     * \brief A fully connected layer.
+     */
+    template<typename WT, typename = void>
+    struct layer_traits {
+        static constexpr bool dense = true;
+
+        /// Size of one input record.
+        static constexpr uint inputs = WT::nrows;
+
+        /// f(A W + b), see forward_one.
+        template<typename AT, typename BT, typename F>
+        static constexpr auto forward(const AT &A, const WT &W, const BT &b, const F &f) {
+            return dot(A,W).map(f, b);
+        }
+
+        /// Like forward, but gives what backpropagation needs.
+        template<typename AT, typename BT, typename F>
+        static constexpr auto train_forward(const AT &A, const WT &W, const BT &b, const F &f) {
+            return forward(A, W, b, f);
+        }
+
+        /// The weight delta, from the inputs and the deltas of the outputs.
+        template<typename AT, typename DT>
+        static constexpr auto weight_delta(const AT &A, const DT &D) {
+            return dot(A.T(), D);
+        }
+
+        /// The deltas of the inputs, before the derivative of their activation function.
+        template<typename DT>
+        static constexpr auto input_delta(const DT &D, const WT &W) {
+            return dot(D, W.T());
+        }
+
+        /// The weights in element type S.
+        template<typename S>
+        static auto cast(const WT &W) {
+            return matrix_cast<S>(W);
+        }
+    };
+
+    /**
+     * \brief Activations of a fully connected layer (or inputs): a Matrix.
+     */
+    template<typename LT, typename = void>
+    struct activation_traits {
+        /// The activations as the next layer gets them.
+        static constexpr const LT &matrix(const LT &L) { return L; }
+
+        /**
+         * \brief The deltas of the layer that computed L, given the deltas
+         *        E of L itself. Their sum over the batch goes in dB.
+         */
+        template<typename ET, typename DBT>
+        static constexpr auto delta(const LT &L, const ET &E, DBT &dB) {
+            return detail::eval_delta(E * L.map(g_), dB);
+        }
+    };
+
+    /// The size of one input record of a net.
+    template<typename Net>
+    constexpr uint net_inputs = layer_traits<std::tuple_element_t<0, Net>>::inputs;
+
+    /// A layer's weights (or biases) in element type S.
+    template<typename S, typename WT>
+    auto cast(const WT &W) {
+        return layer_traits<WT>::template cast<S>(W);
+    }
+
+    /// Weights of any kind of layer, as the plain Matrix they are stored in.
+    template<typename T, uint rows, uint cols>
+    constexpr const Matrix<T,rows,cols> &as_matrix(const Matrix<T,rows,cols> &W) { return W; }
+
+    // }}}
+
     /**
      * \brief Forward propagate one layer.
      *
+     * The bias and activation function are applied by the GEMM kernel
+     * (see expr.hh), so they cost no extra pass over the result.
+     *
      * \param A Matrix of activations of the previous layer (or inputs).
      * \param W Matrix of weights between the previous layer and the next.
+     * \param b Row of biases of the next layer.
      * \param f Activation function to use.
      *
      * \return Matrix of activations of the next layer.
      */
-    template<typename AT, typename WT, typename F = decltype(g)>
-    constexpr auto forward_one(const AT &A, const WT &W, F f = g) {
-        return dot(A,W).map(f);
+    template<typename AT, typename WT, typename BT, typename F = decltype(g)>
+    constexpr auto forward_one(const AT &A, const WT &W, const BT &b, F f = g) {
+        return layer_traits<WT>::forward(A, W, b, f);
     }
 
+    // Output layers (see below).
+    struct sigmoid_mse;
+    struct softmax_cross_entropy;
+
     /**
      * \brief Cheap forward that doesn't keep track of activations.
      *
      * For when you care only about activations in the output layer.
      *
+     * \tparam Out The kind of output layer, e.g. softmax_cross_entropy.
+     *
      * \return A matrix of activations in the output layer.
      */
-    template<typename A1T, typename WT, typename... WsT>
-    constexpr auto forwards(const A1T &A1, const WT &W, const WsT&... Ws) {
-        auto A = forward_one(A1,W);
+    template<typename Out = sigmoid_mse, typename A1T, typename WT, typename BT, typename... WsT>
+    constexpr auto forwards(const A1T &A1, const WT &W, const BT &b, const WsT&... Ws) {
         if constexpr (sizeof...(WsT) > 0)
-            return forwards(A, Ws...);
-        else
-            return A;
+            return forwards<Out>(forward_one(A1,W,b), Ws...);
+        else {
+            static_assert(layer_traits<WT>::dense, "The output layer must be fully connected");
+            return Out::forward(A1,W,b);
+        }
     }
 
     namespace detail {
@@ -116,23 +241,30 @@ namespace nn {
         /**
          * \brief Backward propagation.
          *
-         * - The L* types are activation layer matrix types.
-         * - The W* types are weight matrix types.
+         * - The L* types are activation layer matrix types (or, for
+         *   convolutions, what activation_traits says they keep).
+         * - The W* types are weight matrix types, the B* types bias vector
+         *   types. They come in pairs.
          * - The L*D types are matrices that contain the deltas (error) of
          *   the next layer (the output of the current layer).
+         * - The DB types are the summed deltas of the next layer, that is,
+         *   the deltas of its biases.
          * - The Y type, used only for the first call to train_backward,
          *   (-> the specialization below this one)
          *   contains the *expected* activations of the output layer.
          *
-         * For each step, we pop one layer of activations and weights,
-         * adjust the weights for the current layer and recurse with
-         * the rest of the layers and weights.
+         * For each step, we pop one layer of activations, weights and
+         * biases, hand the weight and bias deltas of the current layer to
+         * the updater and recurse with the rest of the layers and weights.
          *
          * The template parameter packs for lists and weights are passed
          * wrapped in a list type in order to separate them.
+         *
+         * Activations are passed by reference: they are owned by the
+         * train_forward frames further up the call stack.
          */
-        template<typename L1T, typename... LsT, typename WT, typename... WsT>
-        struct train_backward<list<L1T,LsT...>,list<WT,WsT...>> {
+        template<typename L1T, typename... LsT, typename WT, typename BT, typename... WsT>
+        struct train_backward<list<L1T,LsT...>,list<WT,BT,WsT...>> {
             /**
              * \brief Backward propagation.
              *
@@ -142,21 +274,39 @@ namespace nn {
              * As you would expect, this recurses from the output layer towards the input layer.
              *
              * \param L2D The deltas of the *output* side of the weights.
+             * \param DB  The deltas of the biases of the output side.
              * \param L1  The activations of the *input* side of the weights.
              * \param W   The weights.
-             * \param Ws  The rest of the weights, closer to the input layer.
+             * \param B   The biases of the output side.
+             * \param Ws  The rest of the weights and biases, closer to the input layer.
+             * \param u   Receives the weight and bias deltas, see nn::propagate.
              */
-            template<typename L2DT>
-            constexpr static auto f(L2DT L2D, L1T L1, LsT... Ls, WT &W, WsT&... Ws) {
-                // Calculate our own delta.
-                auto D = dot(L2D, W.T()) * L1.map(g_);
-                // Adjust our weights based on our activation and the delta of the *next* layer.
-                W += eta * dot(L1.T(), L2D);
+            template<typename U, typename L2DT, typename DBT>
+            constexpr static auto f(U &u, const L2DT &L2D, const DBT &DB,
+                                    const L1T &L1, const LsT&... Ls,
+                                    WT &W, BT &B, WsT&... Ws) {
+                // The weight delta, based on our activation and the delta of the *next* layer.
+                // This is a lazy product: the updater decides where it goes.
+                auto dW = layer_traits<WT>::weight_delta(activation_traits<L1T>::matrix(L1), L2D);
 
                 // If this is not yet the input layer, recurse and pass along the deltas of this layer.
-                if constexpr (sizeof...(WsT) > 0)
+                if constexpr (sizeof...(WsT) > 0) {
+                    // Calculate our own delta (one GEMM, then one fused
+                    // pass that also sums it for our biases).
+                    // This needs the weights from before the update below.
+                    using B1T = std::tuple_element_t<1, std::tuple<WsT...>>;
+                    Matrix<typename B1T::value_type, 1, B1T::ncols> D1B(matrix_detail::uninitialized);
+                    auto D = activation_traits<L1T>::delta(L1, layer_traits<WT>::input_delta(L2D, W), D1B);
+                    u(layer_index<sizeof...(WsT)>{},     W, dW);
+                    u(layer_index<sizeof...(WsT) + 1>{}, B, DB);
+
                     train_backward<list<LsT...>,list<WsT...>>
-                        ::f(D, Ls..., Ws...);
+                        ::f(u, D, D1B, Ls..., Ws...);
+                } else {
+                    // Nobody needs the deltas of the input layer.
+                    u(layer_index<0>{}, W, dW);
+                    u(layer_index<1>{}, B, DB);
+                }
             }
         };
 
@@ -171,14 +321,16 @@ namespace nn {
          */
         template<typename LAT, typename... LsT, typename... WsT, typename YT>
         struct train_backward<list<LAT,LsT...>,list<WsT...>,YT> {
-            constexpr static auto f(LAT LA, LsT... Ls, WsT&... Ws, const YT &Y) {
+            template<typename Out, typename U>
+            constexpr static auto f(U &u, const LAT &LA, const LsT&... Ls, WsT&... Ws, const YT &Y) {
                 // No weights to update for this step!
                 // Just calculate our own delta and let the rest of the net figure it out.
-                auto D = (Y - LA) * LA.map(g_);
+                Matrix<typename LAT::value_type, 1, LAT::ncols> DB(matrix_detail::uninitialized);
+                auto D = eval_delta(Out::delta(LA, Y), DB);
                 // This should always be true.
                 if constexpr (sizeof...(LsT) > 0)
                     train_backward<list<LsT...>,list<WsT...>>
-                        ::f(D, Ls..., Ws...);
+                        ::f(u, D, DB, Ls..., Ws...);
             }
         };
 
@@ -194,8 +346,8 @@ namespace nn {
          * - Activations per layer are accumulated in LsT
          *   this is our output, and will be input for train_backwards later on.
          * - Weights drip from the WsT list to the WsCT list.
-         *   The WsT weights are our inputs. On each layer we pop one weight type
-         *   from WsT and push it into WsCT, to keep track of our progress.
+         *   The WsT weights are our inputs. On each layer we pop one weight and
+         *   one bias type from WsT and push them into WsCT, to keep track of our progress.
          *   At the end, we will pass WsCT to train_backward so they can be updated.
          */
         template<typename... LsT,
@@ -203,38 +355,44 @@ namespace nn {
         struct train_forward<list<LsT...>,
                              list<>,
                              list<WsCT...>> {
-            template<typename YT>
-            constexpr static auto f(LsT... Ls, WsCT&... Ws, const YT &Y) {
-                return train_backward<list<LsT...>,list<WsCT...>,YT>::f(Ls..., Ws..., Y);
+            template<typename Out, typename U, typename YT>
+            constexpr static auto f(U &u, const LsT&... Ls, WsCT&... Ws, const YT &Y) {
+                return train_backward<list<LsT...>,list<WsCT...>,YT>::template f<Out>(u, Ls..., Ws..., Y);
             }
         };
 
         template<typename... LsT,
                  typename W1T,
+                 typename B1T,
                  typename... WsT,
                  typename... WsCT>
         struct train_forward<list<LsT...>,
-                             list<W1T,WsT...>,
+                             list<W1T,B1T,WsT...>,
                              list<WsCT...>> {
-            template<typename A1T, typename YT>
-            constexpr static auto f(const A1T &A1,
+            template<typename Out, typename U, typename A1T, typename YT>
+            constexpr static auto f(U &u,
+                                    const A1T &A1,
                                     W1T &W1,
+                                    B1T &B1,
                                     WsT&... Ws,
                                     WsCT&... WsC,
-                                    LsT... Ls,
+                                    const LsT&... Ls,
                                     const YT &Y) {
 
-                auto A = forward_one(A1,W1);
+                const auto &X = activation_traits<A1T>::matrix(A1);
                 if constexpr (sizeof...(WsT) > 0) {
+                    auto A = layer_traits<W1T>::train_forward(X, W1, B1, g);
                     return train_forward<list<A1T,LsT...>,
                                          list<WsT...>,
-                                         list<W1T,WsCT...>>
-                           ::f(A, Ws..., W1, WsC..., A1, Ls..., Y);
+                                         list<W1T,B1T,WsCT...>>
+                           ::template f<Out>(u, A, Ws..., W1, B1, WsC..., A1, Ls..., Y);
                 } else {
+                    static_assert(layer_traits<W1T>::dense, "The output layer must be fully connected");
+                    auto A = Out::forward(X,W1,B1);
                     return train_forward<list<decltype(A),A1T,LsT...>,
                                          list<>,
-                                         list<W1T,WsCT...>>
-                           ::f(A, A1, Ls..., W1, WsC..., Y);
+                                         list<W1T,B1T,WsCT...>>
+                           ::template f<Out>(u, A, A1, Ls..., W1, B1, WsC..., Y);
                 }
             }
         };
@@ -271,36 +429,231 @@ namespace nn {
         return detail::get_mse<T1,rows,cols>::f(A, Y);
     }
 
-    template<typename AT, typename YT, typename... WsT>
+    // Output layers. {{{
+
+    /*
+     * An output layer policy decides what the last layer computes: an
+     * element-wise activation, followed by normalize() on every row of
+     * the batch (forward does both). It also gives the delta that
+     * backpropagation starts with (a lazy expression) and the loss.
+     *
+     * For engines that do not work on Matrix (see dynamic.hh), normalize
+     * and loss also take row-major arrays, and delta_one(a, y) is the
+     * delta of a single output.
+     */
+
+    /**
+     * \brief Sigmoid outputs, trained on squared error.
+     */
+    struct sigmoid_mse {
+        static constexpr auto activation = g;
+        static constexpr auto delta_one  = simd::vectorized([](auto a, auto y) { return (y - a) * g_(a); });
+
+        template<typename T>
+        static constexpr void normalize(T*, uint, uint) { }
+
+        template<typename T, uint rows, uint cols>
+        static constexpr void normalize(Matrix<T,rows,cols> &) { }
+
+        template<typename AT, typename WT, typename BT>
+        static constexpr auto forward(const AT &A, const WT &W, const BT &b) {
+            return forward_one(A, W, b, activation);
+        }
+
+        template<typename AT, typename YT>
+        static constexpr auto delta(const AT &A, const YT &Y) {
+            return (Y - A) * A.map(g_);
+        }
+
+        template<typename AT, typename YT>
+        static constexpr double loss(const AT &A, const YT &Y) {
+            return get_mse(A, Y);
+        }
+
+        /// Like get_mse.
+        template<typename T>
+        static constexpr double loss(const T *a, const T *y, uint rows, uint cols) {
+            double sum = 0;
+            for (size_t r = 0; r < rows; ++r) {
+                double row = 0;
+                for (size_t c = r * cols; c < (r + 1) * cols; ++c) {
+                    T d = y[c] - a[c];
+                    row += d * d;
+                }
+                sum += row / (2*cols);
+            }
+            return sum / rows;
+        }
+    };
+
+    /**
+     * \brief Softmax outputs (one probability per class), trained on
+     *        cross-entropy.
+     *
+     * The derivative of the cross-entropy through the softmax is simply
+     * A - Y, so the delta neither vanishes for confidently wrong outputs
+     * (as sigmoid' does) nor needs the logarithm.
+     */
+    struct softmax_cross_entropy {
+        static constexpr auto activation = simd::vectorized([](auto x) { return x; });
+        static constexpr auto delta_one  = simd::vectorized([](auto a, auto y) { return y - a; });
+
+        template<typename AT, typename WT, typename BT>
+        static constexpr auto forward(const AT &A, const WT &W, const BT &b) {
+            auto Z = forward_one(A, W, b, activation);
+            normalize(Z);
+            return Z;
+        }
+
+        template<typename AT, typename YT>
+        static constexpr auto delta(const AT &A, const YT &Y) {
+            return Y - A;
+        }
+
+        /// Mean cross-entropy per row.
+        template<typename T>
+        static double loss(const T *a, const T *y, uint rows, uint cols) {
+            double sum = 0;
+            for (size_t i = 0; i < size_t(rows) * cols; ++i)
+                if (y[i] > 0)
+                    sum -= y[i] * std::log(std::max(double(a[i]), 1e-300));
+            return sum / rows;
+        }
+
+        template<typename AT, typename YT>
+        static double loss(const AT &A, const YT &Y) {
+            return loss(A.data(), Y.data(), AT::nrows, AT::ncols);
+        }
+
+        /**
+         * \brief Replace every row of logits by its softmax, in place.
+         *
+         * Each row is shifted by its maximum first, so that exp cannot
+         * overflow (this is the log-sum-exp trick). The exponentials are
+         * then taken in one vectorized pass over the whole batch; only
+         * the maxima and the sums are done per row.
+         */
+        template<typename T>
+        static constexpr void normalize(T *z, uint rows, uint cols) {
+            for (uint r = 0; r < rows; ++r) {
+                T *row = z + size_t(r) * cols;
+                T max = row[0];
+                for (uint c = 1; c < cols; ++c)
+                    max = std::max(max, row[c]);
+                for (uint c = 0; c < cols; ++c)
+                    row[c] -= max;
+            }
+
+            simd::transform(size_t(rows) * cols, z,
+                            simd::vectorized([](auto x) { return simd::exp(x); }), z);
+
+            for (uint r = 0; r < rows; ++r) {
+                T *row = z + size_t(r) * cols;
+                T sum = 0;
+                for (uint c = 0; c < cols; ++c)
+                    sum += row[c];
+                T inv = 1 / sum;
+                for (uint c = 0; c < cols; ++c)
+                    row[c] *= inv;
+            }
+        }
+
+        template<typename T, uint rows, uint cols>
+        static constexpr void normalize(Matrix<T,rows,cols> &Z) {
+            normalize(Z.data(), rows, cols);
+        }
+    };
+
+    // }}}
+
+    namespace detail {
+        /// Plain gradient descent: the delta is accumulated straight into W.
+        struct sgd {
+            template<uint I, typename WT, typename DWT>
+            constexpr void operator()(layer_index<I>, WT &W, const DWT &dW) const {
+                W += eta * dW;
+            }
+        };
+    }
+
+    /**
+     * \brief Forward and backward propagate one batch.
+     *
+     * Instead of adjusting the weights itself, this calls
+     * `u(layer_index<I>{}, W, dW)` for every weight matrix and bias
+     * vector, where dW is the unscaled delta (lazy for weights, see
+     * expr.hh). The output layer comes first.
+     *
+     * All deltas are computed from the weights as they were before the
+     * call, so the updater may modify W right away.
+     *
+     * \tparam Out The kind of output layer (see above).
+     */
+    template<typename Out = sigmoid_mse, typename U, typename AT, typename YT, typename... WsT>
+    constexpr auto propagate(U &&u, const AT &A, const YT &Y, WsT&... Ws) {
+        return detail::train_forward<list<>,list<WsT...>,list<>>::template f<Out>(u, A, Ws..., Y);
+    }
+
+    /**
+     * \brief Train the net on one batch, using gradient descent.
+     */
+    template<typename Out = sigmoid_mse, typename AT, typename YT, typename... WsT>
     constexpr auto train(const AT &A, const YT &Y, WsT&... Ws) {
-        return detail::train_forward<list<>,list<WsT...>,list<>>::f(A, Ws..., Y);
+        return propagate<Out>(detail::sgd{}, A, Y, Ws...);
     }
 
     namespace detail2 {
         template<typename T, uint InCount, uint OutCount>
         using Layer = Matrix<T, InCount, OutCount>;
 
+        template<typename T, uint OutCount>
+        using Bias = Matrix<T, 1, OutCount>;
+
+        /// The weights and biases of one layer.
+        template<typename T, uint InCount, uint OutCount>
+        using LayerBias = std::tuple<Layer<T,InCount,OutCount>, Bias<T,OutCount>>;
+
         template<typename T, uint I, uint O, uint N>
         struct netcat {
             template<typename... HT>
             struct c {
-                using type = std::tuple<Layer<T,I,N>,
-                                        HT...,
-                                        Layer<T,N,O>>;
+                using type = decltype(std::tuple_cat(std::declval<LayerBias<T,I,N>>(),
+                                                     std::declval<HT>()...,
+                                                     std::declval<LayerBias<T,N,O>>()));
             };
         };
 
         template<typename T, uint I, uint O, uint H, uint N>
         struct make_net {
-            using type = typename repeat<netcat<T,I,O,N>::template c,Layer<T,N,N>,H-1>::type;
+            using type = typename repeat<netcat<T,I,O,N>::template c,LayerBias<T,N,N>,H-1>::type;
         };
 
         template<typename T, uint I, uint O, uint N>
         struct make_net<T,I,O,0,N> {
-            using type = std::tuple<Layer<T,I,O>>;
+            using type = LayerBias<T,I,O>;
         };
     }
 
+    namespace detail {
+        template<typename Net, typename F, size_t... Is>
+        constexpr void for_each_layer(Net &net, F &f, std::index_sequence<Is...>) {
+            (f(std::get<2*Is>(net), std::get<2*Is+1>(net)), ...);
+        }
+    }
+
+    /**
+     * \brief Call f(W, b) with the weights and biases of every layer,
+     *        input layer first.
+     */
+    template<typename Net, typename F>
+    constexpr void for_each_layer(Net &net, F f) {
+        detail::for_each_layer(net, f, std::make_index_sequence<std::tuple_size<Net>::value / 2> { });
+    }
+
+    /**
+     * \brief The type of a net: a tuple of weight matrices and bias rows,
+     *        alternating, starting at the input layer.
+     */
     template<typename T,
              uint Inputs,
              uint Outputs,
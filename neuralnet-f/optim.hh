@@ -0,0 +1,331 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief Optimizers: what to do with the deltas of nn::propagate.
+ *
+ * An optimizer combines an update rule (sgd, momentum, nesterov,
+ * rmsprop, adam) with a learning rate schedule. It keeps the state of
+ * the rule (e.g. the moments of Adam) in matrices shaped like each
+ * weight matrix and bias row of the net.
+ *
+ * The state and the weights are updated in a single pass: for each
+ * element, the delta, the weight and the state are loaded once, and the
+ * new weight and state are stored once.
+ *
+ * As everywhere in nn.hh, a delta points downhill (W += eta * dW is
+ * plain gradient descent).
+ */
+
+#include "common.hh"
+#include "matrix.hh"
+#include "nn.hh"
+#include "simd.hh"
+#include <array>
+#include <cmath>
+#include <tuple>
+#include <type_traits>
+
+namespace optim {
+
+    // Learning rate schedules. {{{
+
+    /// The same learning rate for every step.
+    struct constant {
+        double eta = nn::eta;
+
+        double operator()(uint64_t) const { return eta; }
+    };
+
+    /// Multiply the learning rate by `factor` every `every` steps.
+    struct step_decay {
+        double   eta    = nn::eta;
+        double   factor = 0.5;
+        uint64_t every  = 1000;
+
+        double operator()(uint64_t t) const { return eta * std::pow(factor, double(t / every)); }
+    };
+
+    /// Multiply the learning rate by `gamma` every step.
+    struct exponential_decay {
+        double eta   = nn::eta;
+        double gamma = 0.9999;
+
+        double operator()(uint64_t t) const { return eta * std::pow(gamma, double(t)); }
+    };
+
+    /// Go from eta to eta_min along half a cosine in `steps` steps, then stay there.
+    struct cosine {
+        double   eta     = nn::eta;
+        double   eta_min = 0;
+        uint64_t steps   = 10000;
+
+        double operator()(uint64_t t) const {
+            if (t >= steps)
+                return eta_min;
+            const double pi = std::acos(-1.0);
+            return eta_min + (eta - eta_min) * (1 + std::cos(pi * double(t) / steps)) / 2;
+        }
+    };
+
+    // }}}
+    // Update rules. {{{
+
+    /*
+     * A rule has `slots` state elements per weight, and a prepare<T>(lr, t)
+     * that gives the update for step t (counting from 1) as a function
+     * object. That is called as `f(d, s)`, with d a delta (a scalar or a
+     * vector, see simd.hh) and s an array of `slots` state values of the
+     * same type, which it may modify. It returns what to add to the weight.
+     */
+
+    /// Plain gradient descent.
+    struct sgd {
+        static constexpr uint slots = 0;
+
+        template<typename T>
+        struct update {
+            T lr;
+
+            template<typename V>
+            V operator()(V d, V *) const { return lr * d; }
+        };
+
+        template<typename T>
+        update<T> prepare(double lr, uint64_t) const { return { T(lr) }; }
+    };
+
+    /// Gradient descent with (heavy ball) momentum.
+    struct momentum {
+        double mu = 0.9;
+
+        static constexpr uint slots = 1;
+
+        template<typename T>
+        struct update {
+            T lr, mu;
+
+            template<typename V>
+            V operator()(V d, V *s) const {
+                s[0] = mu * s[0] + d;
+                return lr * s[0];
+            }
+        };
+
+        template<typename T>
+        update<T> prepare(double lr, uint64_t) const { return { T(lr), T(mu) }; }
+    };
+
+    /// Nesterov momentum: the step is taken from where momentum alone would go.
+    struct nesterov {
+        double mu = 0.9;
+
+        static constexpr uint slots = 1;
+
+        template<typename T>
+        struct update {
+            T lr, mu;
+
+            template<typename V>
+            V operator()(V d, V *s) const {
+                s[0] = mu * s[0] + d;
+                return lr * (d + mu * s[0]);
+            }
+        };
+
+        template<typename T>
+        update<T> prepare(double lr, uint64_t) const { return { T(lr), T(mu) }; }
+    };
+
+    /// Deltas divided by a running RMS of themselves.
+    struct rmsprop {
+        double rho     = 0.9;
+        double epsilon = 1e-8;
+
+        static constexpr uint slots = 1;
+
+        template<typename T>
+        struct update {
+            T lr, rho, epsilon;
+
+            template<typename V>
+            V operator()(V d, V *s) const {
+                s[0] = rho * s[0] + (1 - rho) * d * d;
+                return lr * d / (simd::sqrt(s[0]) + epsilon);
+            }
+        };
+
+        template<typename T>
+        update<T> prepare(double lr, uint64_t) const { return { T(lr), T(rho), T(epsilon) }; }
+    };
+
+    /// Adam (Kingma & Ba), with the bias corrections folded into the step size.
+    struct adam {
+        double beta1   = 0.9;
+        double beta2   = 0.999;
+        double epsilon = 1e-8;
+
+        static constexpr uint slots = 2;
+
+        template<typename T>
+        struct update {
+            T lr, beta1, beta2, epsilon;
+
+            template<typename V>
+            V operator()(V d, V *s) const {
+                s[0] = beta1 * s[0] + (1 - beta1) * d;
+                s[1] = beta2 * s[1] + (1 - beta2) * d * d;
+                return lr * s[0] / (simd::sqrt(s[1]) + epsilon);
+            }
+        };
+
+        template<typename T>
+        update<T> prepare(double lr, uint64_t t) const {
+            // lr * m/(1-beta1^t) / (sqrt(v/(1-beta2^t)) + epsilon)
+            double c2 = std::sqrt(1 - std::pow(beta2, double(t)));
+            double c1 = 1 - std::pow(beta1, double(t));
+            return { T(lr * c2 / c1), T(beta1), T(beta2), T(epsilon * c2) };
+        }
+    };
+
+    // }}}
+
+    namespace detail {
+
+        /**
+         * \brief w[i] += f(d[i], state...), updating the state, in one pass.
+         */
+        template<size_t n, typename T, size_t N, typename F>
+        inline void fused_update(T *w, const T *d, const std::array<T*,N> &s, const F &f) {
+            constexpr size_t m = simd::supported<T> ? n / simd::width<T> * simd::width<T> : 0;
+
+            if constexpr (m > 0) {
+                using V = simd::vec<T>;
+                constexpr size_t W = simd::width<T>;
+
+                for (size_t i = 0; i < m; i += W) {
+                    V sv[N ? N : 1];
+                    for (size_t k = 0; k < N; ++k)
+                        sv[k] = simd::load<V>(s[k] + i);
+                    simd::store(w + i, simd::load<V>(w + i) + f(simd::load<V>(d + i), sv));
+                    for (size_t k = 0; k < N; ++k)
+                        simd::store(s[k] + i, sv[k]);
+                }
+            }
+            for (size_t i = m; i < n; ++i) {
+                T sv[N ? N : 1];
+                for (size_t k = 0; k < N; ++k)
+                    sv[k] = s[k][i];
+                w[i] += f(d[i], sv);
+                for (size_t k = 0; k < N; ++k)
+                    s[k][i] = sv[k];
+            }
+        }
+    }
+
+    template<typename Net, typename Rule = sgd, typename Schedule = constant>
+    class optimizer;
+
+    /**
+     * \brief Trains a net made with nn::make_net using an update rule
+     *        and a learning rate schedule.
+     *
+     * This is an updater for nn::propagate; train() does one step.
+     */
+    template<typename... WsT, typename Rule, typename Schedule>
+    class optimizer<std::tuple<WsT...>, Rule, Schedule> {
+        Rule     rule;
+        Schedule schedule;
+
+        // Rule state, per weight matrix and bias row.
+        std::tuple<std::array<WsT, Rule::slots>...> state;
+
+        // Weight deltas arrive as lazy products; rules other than sgd
+        // compute them here first. Kept between steps to avoid
+        // reallocating.
+        struct no_deltas { };
+        std::conditional_t<std::is_same<Rule, sgd>::value,
+                           no_deltas,
+                           std::tuple<WsT...>> deltas;
+
+        uint64_t t  = 0;
+        double   lr = 0;
+
+    public:
+        explicit optimizer(Rule rule = { }, Schedule schedule = { })
+            : rule(rule),
+              schedule(schedule)
+            { }
+
+        /// Amount of steps taken.
+        uint64_t steps() const { return t; }
+
+        /// The learning rate of the current (or, before the first, the next) step.
+        double rate() const { return t ? lr : schedule(0); }
+
+        /**
+         * \brief Start a new step.
+         *
+         * train() does this itself; call it when using this optimizer as
+         * an updater directly (e.g. from parallel_trainer).
+         */
+        void step() {
+            lr = schedule(t);
+            ++t;
+        }
+
+        /// Update one weight matrix or bias row, see nn::propagate.
+        template<uint I, typename WT, typename DWT>
+        void operator()(nn::layer_index<I>, WT &W, const DWT &dW) {
+            using T = typename WT::value_type;
+
+            if constexpr (std::is_same<Rule, sgd>::value) {
+                // Nothing to fuse: let the GEMM kernel add (lazy) deltas to W.
+                W += T(lr) * dW;
+            } else {
+                const T *d;
+                if constexpr (matrix_expr::is_matrix<std::decay_t<DWT>>::value) {
+                    d = dW.data();
+                } else {
+                    auto &D = std::get<I>(deltas);
+                    D = dW;
+                    d = D.data();
+                }
+
+                std::array<T*, Rule::slots> s;
+                for (uint k = 0; k < Rule::slots; ++k)
+                    s[k] = std::get<I>(state)[k].data();
+
+                detail::fused_update<WT::size()>(W.data(), d, s,
+                                                 rule.template prepare<T>(lr, t));
+            }
+        }
+
+        /**
+         * \brief Train the net on one batch, like nn::train.
+         *
+         * \tparam Out The kind of output layer, see nn.hh.
+         */
+        template<typename Out = nn::sigmoid_mse, typename AT, typename YT>
+        void train(const AT &X, const YT &Y, std::tuple<WsT...> &net) {
+            step();
+            std::apply([&](auto&...W) { nn::propagate<Out>(*this, X, Y, W...); }, net);
+        }
+    };
+}
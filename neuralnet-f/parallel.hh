@@ -0,0 +1,236 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief Data-parallel training.
+ *
+ * A batch is split into a fixed number of shards. Each shard is
+ * propagated on its own (on whichever thread picks it up), and the
+ * weight deltas of all shards are then summed in shard order.
+ *
+ * Since the split and the order of summation depend only on the shard
+ * count and not on the amount of threads, the trained weights are the
+ * same for any amount of threads.
+ */
+
+#include "common.hh"
+#include "matrix.hh"
+#include "nn.hh"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace nn {
+
+    /**
+     * \brief A fixed set of worker threads.
+     *
+     * The calling thread takes part in the work as well, so a pool of
+     * size 1 has no workers and runs everything inline.
+     */
+    class thread_pool {
+        std::vector<std::thread> workers;
+
+        std::mutex              mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+
+        // The current job. Guarded by `mutex`, except for `next`.
+        const std::function<void(uint)> *job = nullptr;
+        uint                    count      = 0;
+        std::atomic<uint>       next       { 0 };
+        unsigned long           generation = 0;
+        uint                    finished   = 0;
+        bool                    stopping   = false;
+
+        void work() {
+            for (uint i; (i = next++) < count; )
+                (*job)(i);
+        }
+
+        void worker() {
+            unsigned long seen = 0;
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [&] { return stopping || generation != seen; });
+                    if (stopping)
+                        return;
+                    seen = generation;
+                }
+                work();
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ++finished;
+                }
+                done.notify_one();
+            }
+        }
+
+    public:
+        /**
+         * \param threads Total amount of threads, including the caller.
+         *                0 means one per hardware thread.
+         */
+        explicit thread_pool(uint threads = 0) {
+            if (!threads)
+                threads = std::max(1U, std::thread::hardware_concurrency());
+            for (uint i = 1; i < threads; ++i)
+                workers.emplace_back([this] { worker(); });
+        }
+
+        ~thread_pool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto &t : workers)
+                t.join();
+        }
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool &operator=(const thread_pool&) = delete;
+
+        uint size() const { return workers.size() + 1; }
+
+        /**
+         * \brief Call f(0) .. f(n-1), spread over all threads.
+         *
+         * Returns when all calls have finished.
+         */
+        void run(uint n, const std::function<void(uint)> &f) {
+            if (workers.empty() || n <= 1) {
+                for (uint i = 0; i < n; ++i)
+                    f(i);
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job      = &f;
+                count    = n;
+                next     = 0;
+                finished = 0;
+                ++generation;
+            }
+            wake.notify_all();
+
+            work();
+
+            // Every worker must have seen this job before the next one is posted.
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [&] { return finished == workers.size(); });
+            job = nullptr;
+        }
+    };
+
+    template<uint Shards, typename Net>
+    class parallel_trainer;
+
+    /**
+     * \brief Trains a net made with make_net on batches split into `Shards` parts.
+     *
+     * \tparam Shards Amount of parts to split each batch into.
+     *                This, and not the amount of threads, determines the result.
+     */
+    template<uint Shards, typename... WsT>
+    class parallel_trainer<Shards, std::tuple<WsT...>> {
+        static_assert(Shards > 0, "Need at least one shard");
+
+        using deltas_type = std::tuple<WsT...>;
+
+        thread_pool pool;
+
+        // Per shard weight deltas, kept between batches to avoid reallocating.
+        std::vector<deltas_type> deltas;
+
+        /// Copy rows [first, first+R) of a batch into a shard.
+        template<typename T1, uint R, uint B, uint C>
+        static void slice(const Matrix<T1,B,C> &from, uint first, Matrix<T1,R,C> &to) {
+            std::memcpy(to.data(), from.data() + size_t(first) * C, sizeof(T1) * R * C);
+        }
+
+        template<size_t... Is, typename W, typename U>
+        void reduce(std::index_sequence<Is...>, W &net, U &u) {
+            (reduce_one<Is>(std::get<Is>(net), u), ...);
+        }
+
+        template<size_t I, typename W, typename U>
+        void reduce_one(W &w, U &u) {
+            auto &sum = std::get<I>(deltas[0]);
+            for (uint s = 1; s < Shards; ++s)
+                sum += as_matrix(std::get<I>(deltas[s]));
+            u(layer_index<I>{}, w, as_matrix(sum));
+        }
+
+    public:
+        /**
+         * \param threads Total amount of threads, 0 for one per hardware thread.
+         *                There is no use in having more threads than shards.
+         */
+        explicit parallel_trainer(uint threads = 0)
+            : pool(std::min(threads ? threads : std::max(1U, std::thread::hardware_concurrency()),
+                            Shards)),
+              deltas(Shards)
+            { }
+
+        uint threads() const { return pool.size(); }
+
+        /**
+         * \brief Train the net on one batch, like nn::propagate.
+         *
+         * The summed deltas of all shards are passed to `u`, by default
+         * plain gradient descent (like nn::train). See optim.hh for others.
+         *
+         * \tparam Out The kind of output layer, see nn.hh.
+         */
+        template<typename Out = sigmoid_mse, typename T1, uint B, uint I, uint O, typename U = detail::sgd>
+        void train(const Matrix<T1,B,I> &X, const Matrix<T1,B,O> &Y, std::tuple<WsT...> &net,
+                   U &&u = { }) {
+            static_assert(B % Shards == 0, "Batch size must be a multiple of the shard count");
+            constexpr uint R = B / Shards;
+
+            pool.run(Shards, [&](uint s) {
+                // Shards of the first layer are big: keep them off the thread's stack.
+                auto Xs = std::make_unique<Matrix<T1,R,I>>(matrix_detail::uninitialized);
+                auto Ys = std::make_unique<Matrix<T1,R,O>>(matrix_detail::uninitialized);
+                slice(X, s * R, *Xs);
+                slice(Y, s * R, *Ys);
+
+                auto &d = deltas[s];
+                std::apply([&](auto&...W) {
+                    propagate<Out>([&](auto i, auto&, const auto &dW) {
+                                  std::get<decltype(i)::value>(d) = dW;
+                              }, *Xs, *Ys, W...);
+                }, net);
+            });
+
+            // Summed in shard order, whatever thread computed what.
+            reduce(std::index_sequence_for<WsT...> { }, net, u);
+        }
+    };
+}
@@ -0,0 +1,305 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief Int8 inference for trained nets.
+ *
+ * quantize() turns the weights of a make_net tuple into signed 8-bit
+ * integers with one scale per column (output neuron). quant::forwards()
+ * then runs the net on integers:
+ *
+ * - Activations (and inputs) are unsigned 7-bit: [0, 1] maps to 0..127.
+ *   That covers sigmoid outputs and normalized pixels, and keeps the
+ *   AVX2 kernel (whose pairwise 16-bit sums saturate above 32767) exact.
+ * - Products are accumulated in 32 bits.
+ * - Each accumulator is scaled back to a real weighted sum, the (float)
+ *   bias is added, and the result is put through the activation function
+ *   and requantized for the next layer. The output layer is left in float.
+ *
+ * Weights are packed for the widest available instruction:
+ * AVX-512 VNNI (vpdpbusd, 16 columns), AVX-VNNI (8 columns),
+ * AVX2 (vpmaddubsw + vpmaddwd, 8 columns), or plain C++.
+ */
+
+#include "common.hh"
+#include "matrix.hh"
+#include "nn.hh"
+#include "simd.hh"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if !defined(MATRIX_NO_SIMD) && (defined(__AVX2__) || defined(__AVX512VNNI__))
+#include <immintrin.h>
+#endif
+
+namespace quant {
+
+    /// Largest activation value; the activation scale is 1/act_max.
+    constexpr int act_max = 127;
+
+    namespace detail {
+
+        #if !defined(MATRIX_NO_SIMD) && defined(__AVX512VNNI__)
+        constexpr uint CB = 16;
+        #else
+        constexpr uint CB = 8;
+        #endif
+
+        /// Rows per micro-kernel call.
+        constexpr uint RB = 4;
+
+        /// Inner dimensions are padded to groups of 4 (one 32-bit lane of bytes).
+        constexpr uint pad4(uint k) { return (k + 3) / 4 * 4; }
+
+        inline int32_t load4(const uint8_t *p) {
+            int32_t x;
+            std::memcpy(&x, p, 4);
+            return x;
+        }
+
+        /**
+         * \brief Multiply R rows of activations with one packed column block.
+         *
+         * \param a   R rows of k4*4 activations, lda bytes apart.
+         * \param w   A packed column block: for each group of 4 rows of
+         *            the weights, CB columns of 4 consecutive weights.
+         * \param out R x CB accumulators.
+         */
+        template<uint R>
+        inline void kernel(const uint8_t *a, size_t lda, const int8_t *w, uint k4, int32_t *out) {
+            #if !defined(MATRIX_NO_SIMD) && defined(__AVX512VNNI__)
+            __m512i acc[R];
+            for (uint r = 0; r < R; ++r)
+                acc[r] = _mm512_setzero_si512();
+            for (uint k = 0; k < k4; ++k) {
+                __m512i wv = _mm512_loadu_si512(w + k * CB * 4);
+                for (uint r = 0; r < R; ++r)
+                    acc[r] = _mm512_dpbusd_epi32(acc[r], _mm512_set1_epi32(load4(a + r*lda + k*4)), wv);
+            }
+            for (uint r = 0; r < R; ++r)
+                _mm512_storeu_si512(out + r * CB, acc[r]);
+
+            #elif !defined(MATRIX_NO_SIMD) && defined(__AVXVNNI__)
+            __m256i acc[R];
+            for (uint r = 0; r < R; ++r)
+                acc[r] = _mm256_setzero_si256();
+            for (uint k = 0; k < k4; ++k) {
+                __m256i wv = _mm256_loadu_si256((const __m256i*)(w + k * CB * 4));
+                for (uint r = 0; r < R; ++r)
+                    acc[r] = _mm256_dpbusd_avx_epi32(acc[r], _mm256_set1_epi32(load4(a + r*lda + k*4)), wv);
+            }
+            for (uint r = 0; r < R; ++r)
+                _mm256_storeu_si256((__m256i*)(out + r * CB), acc[r]);
+
+            #elif !defined(MATRIX_NO_SIMD) && defined(__AVX2__)
+            const __m256i ones = _mm256_set1_epi16(1);
+            __m256i acc[R];
+            for (uint r = 0; r < R; ++r)
+                acc[r] = _mm256_setzero_si256();
+            for (uint k = 0; k < k4; ++k) {
+                __m256i wv = _mm256_loadu_si256((const __m256i*)(w + k * CB * 4));
+                for (uint r = 0; r < R; ++r) {
+                    // u7 * s8 pairs fit in 16 bits, so this never saturates.
+                    __m256i p = _mm256_maddubs_epi16(_mm256_set1_epi32(load4(a + r*lda + k*4)), wv);
+                    acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(p, ones));
+                }
+            }
+            for (uint r = 0; r < R; ++r)
+                _mm256_storeu_si256((__m256i*)(out + r * CB), acc[r]);
+
+            #else
+            for (uint r = 0; r < R; ++r) {
+                int32_t *o = out + r * CB;
+                std::fill(o, o + CB, 0);
+                for (uint k = 0; k < k4; ++k)
+                    for (uint j = 0; j < CB; ++j)
+                        for (uint kk = 0; kk < 4; ++kk)
+                            o[j] += int32_t(a[r*lda + k*4 + kk]) * w[(k*CB + j)*4 + kk];
+            }
+            #endif
+        }
+    }
+
+    /**
+     * \brief One quantized layer (I inputs, O outputs).
+     */
+    template<uint I, uint O>
+    struct layer {
+        static constexpr uint inputs  = I;
+        static constexpr uint outputs = O;
+        static constexpr uint K  = detail::pad4(I);                      ///< Padded input count.
+        static constexpr uint NB = (O + detail::CB - 1) / detail::CB;   ///< Column blocks.
+
+        std::vector<int8_t> w;     ///< Packed weights, NB blocks of K x CB.
+        std::vector<float>  scale; ///< Per column: weight scale / act_max.
+        std::vector<float>  bias;  ///< Per column.
+
+        template<typename WT, typename BT>
+        layer(const WT &W, const BT &b)
+            : w(size_t(NB) * K * detail::CB, 0),
+              scale(size_t(NB) * detail::CB, 0),
+              bias(size_t(NB) * detail::CB, 0) {
+
+            static_assert(WT::nrows == I && WT::ncols == O && BT::nrows == 1 && BT::ncols == O,
+                          "Layer dimension mismatch");
+
+            using detail::CB;
+            for (uint j = 0; j < O; ++j) {
+                bias[j] = float(b.data()[j]);
+
+                double max = 0;
+                for (uint i = 0; i < I; ++i)
+                    max = std::max(max, std::abs(double(W.data()[size_t(i) * O + j])));
+                double s = max > 0 ? max / 127 : 1;
+                scale[j] = float(s / act_max);
+
+                uint jb = j / CB, jj = j % CB;
+                for (uint i = 0; i < I; ++i) {
+                    double q = std::round(double(W.data()[size_t(i) * O + j]) / s);
+                    w[((size_t(jb) * K/4 + i/4) * CB + jj) * 4 + i%4]
+                        = int8_t(std::clamp(q, -127.0, 127.0));
+                }
+            }
+        }
+    };
+
+    namespace detail {
+        template<typename Net, size_t... Is>
+        auto quantize(const Net &net, std::index_sequence<Is...>) {
+            return std::make_tuple(layer<std::tuple_element_t<2*Is, Net>::nrows,
+                                         std::tuple_element_t<2*Is, Net>::ncols>
+                                       (std::get<2*Is>(net), std::get<2*Is+1>(net))...);
+        }
+    }
+
+    /**
+     * \brief Quantize a net made with nn::make_net.
+     */
+    template<typename... WsT>
+    auto quantize(const std::tuple<WsT...> &net) {
+        static_assert(sizeof...(WsT) % 2 == 0, "Expected pairs of weights and biases");
+        static_assert((nn::layer_traits<WsT>::dense && ...), "Only fully connected layers can be quantized");
+        return detail::quantize(net, std::make_index_sequence<sizeof...(WsT) / 2> { });
+    }
+
+    namespace detail {
+
+        /// Quantize n real activations in [0, 1].
+        template<typename T>
+        inline void requantize(const T *x, uint n, uint8_t *out) {
+            // Written without branches so that it vectorizes.
+            for (uint i = 0; i < n; ++i) {
+                float q = float(x[i]) * act_max + 0.5f;
+                q = q < 0 ? 0 : q;
+                q = q > act_max ? act_max : q;
+                out[i] = uint8_t(int32_t(q));
+            }
+        }
+
+        /**
+         * \brief Run one quantized layer.
+         *
+         * Writes the activations of row r to out + r * ldo: requantized
+         * when U is uint8_t, as float otherwise. Only the first O
+         * columns of each row are written. f is the activation.
+         */
+        template<typename U, uint B, uint I, uint O, typename F = decltype(nn::g)>
+        void run_layer(const Matrix<uint8_t,B,pad4(I)> &A, const layer<I,O> &L, U *out, size_t ldo,
+                       const F &f = nn::g) {
+            constexpr uint K = pad4(I);
+            alignas(64) int32_t acc[RB * CB];
+            alignas(64) float   z[CB];
+
+            for (uint jb = 0; jb < L.NB; ++jb) {
+                const int8_t *w = L.w.data() + size_t(jb) * K * CB;
+                const float  *s = L.scale.data() + size_t(jb) * CB;
+                const float  *b = L.bias.data()  + size_t(jb) * CB;
+                uint nc = std::min(CB, O - jb * CB);
+
+                auto epilogue = [&](uint row, uint rows) {
+                    for (uint r = 0; r < rows; ++r) {
+                        for (uint j = 0; j < CB; ++j)
+                            z[j] = float(acc[r * CB + j]) * s[j] + b[j];
+                        simd::transform(CB, z, f, z);
+                        U *o = out + size_t(row + r) * ldo + jb * CB;
+                        if constexpr (std::is_same_v<U, uint8_t>)
+                            requantize(z, nc, o);
+                        else
+                            std::copy(z, z + nc, o);
+                    }
+                };
+
+                uint i = 0;
+                for (; i + RB <= B; i += RB) {
+                    kernel<RB>(A.data() + size_t(i) * K, K, w, K / 4, acc);
+                    epilogue(i, RB);
+                }
+                for (; i < B; ++i) {
+                    kernel<1>(A.data() + size_t(i) * K, K, w, K / 4, acc);
+                    epilogue(i, 1);
+                }
+            }
+        }
+
+        template<typename Out, uint B, uint I, uint O, typename... Ls>
+        auto forwards(const Matrix<uint8_t,B,pad4(I)> &A, const layer<I,O> &L, const Ls&... rest) {
+            if constexpr (sizeof...(Ls) > 0) {
+                constexpr uint K2 = pad4(O);
+                Matrix<uint8_t,B,K2> A2(matrix_detail::uninitialized);
+                run_layer(A, L, A2.data(), K2);
+                for (uint r = 0; r < B; ++r)
+                    std::fill(A2.data() + size_t(r) * K2 + O, A2.data() + size_t(r + 1) * K2, 0);
+                return forwards<Out>(A2, rest...);
+            } else {
+                // The output layer stays in float, so its activation
+                // need not be in [0, 1].
+                Matrix<float,B,O> Y(matrix_detail::uninitialized);
+                run_layer(A, L, Y.data(), O, Out::activation);
+                Out::normalize(Y);
+                return Y;
+            }
+        }
+    }
+
+    /**
+     * \brief Forward propagate a batch through a quantized net.
+     *
+     * Inputs are expected in [0, 1], like nn::forwards on MNIST.
+     *
+     * \tparam Out The kind of output layer the net was trained with, see nn.hh.
+     *
+     * \return The activations of the output layer, as floats.
+     */
+    template<typename Out = nn::sigmoid_mse, typename T, uint B, uint I, typename... Ls>
+    Matrix<float,B,std::tuple_element_t<sizeof...(Ls)-1, std::tuple<Ls...>>::outputs>
+    forwards(const Matrix<T,B,I> &X, const std::tuple<Ls...> &net) {
+        constexpr uint K = detail::pad4(I);
+        Matrix<uint8_t,B,K> A(matrix_detail::uninitialized);
+        for (uint r = 0; r < B; ++r) {
+            detail::requantize(X.data() + size_t(r) * I, I, A.data() + size_t(r) * K);
+            std::fill(A.data() + size_t(r) * K + I, A.data() + size_t(r + 1) * K, 0);
+        }
+        return std::apply([&](const auto&... L) { return detail::forwards<Out>(A, L...); }, net);
+    }
+}
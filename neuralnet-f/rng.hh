@@ -0,0 +1,175 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief Small, fast, seedable random number generators.
+ *
+ * Unlike rand(), these produce the same sequence on every platform, and
+ * a generator can be split into independent streams (one per thread,
+ * one per epoch, ...) without sharing state.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace rng {
+
+    /**
+     * \brief SplitMix64.
+     *
+     * Mostly used to turn a single seed into the state of a bigger generator.
+     */
+    class splitmix64 {
+        uint64_t x;
+
+    public:
+        using result_type = uint64_t;
+
+        constexpr explicit splitmix64(uint64_t seed = 0) : x(seed) { }
+
+        constexpr uint64_t operator()() {
+            uint64_t z = (x += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            return z ^ (z >> 31);
+        }
+
+        static constexpr uint64_t min() { return 0; }
+        static constexpr uint64_t max() { return std::numeric_limits<uint64_t>::max(); }
+    };
+
+    /**
+     * \brief The stream for initial weights.
+     *
+     * Epoch e of a sampler uses stream e, so weights come from the other
+     * end of the range.
+     */
+    constexpr uint64_t init_stream = ~uint64_t(0);
+
+    /**
+     * \brief xoshiro256** (Blackman & Vigna).
+     *
+     * Meets the UniformRandomBitGenerator requirements, so it can be
+     * used with <random> and <algorithm> as well.
+     */
+    class xoshiro256ss {
+        uint64_t s[4] { };
+
+        static constexpr uint64_t rotl(uint64_t x, int k) {
+            return (x << k) | (x >> (64 - k));
+        }
+
+    public:
+        using result_type = uint64_t;
+
+        /**
+         * \param seed   Any value, including 0.
+         * \param stream Selects one of 2^64 independently seeded sequences for the same seed.
+         */
+        constexpr explicit xoshiro256ss(uint64_t seed = 0, uint64_t stream = 0) {
+            splitmix64 sm(splitmix64(splitmix64(seed)() ^ stream)());
+            for (auto &x : s)
+                x = sm();
+        }
+
+        constexpr uint64_t operator()() {
+            uint64_t result = rotl(s[1] * 5, 7) * 9;
+            uint64_t t = s[1] << 17;
+
+            s[2] ^= s[0];
+            s[3] ^= s[1];
+            s[1] ^= s[2];
+            s[0] ^= s[3];
+            s[2] ^= t;
+            s[3] = rotl(s[3], 45);
+
+            return result;
+        }
+
+        /// Advance by 2^128 steps.
+        constexpr void jump() {
+            constexpr uint64_t J[] = { 0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+                                       0xa9582618e03fc9aa, 0x39abdc4529b1661c };
+            uint64_t t[4] { };
+            for (uint64_t j : J) {
+                for (int b = 0; b < 64; ++b) {
+                    if (j & uint64_t(1) << b)
+                        for (int i = 0; i < 4; ++i)
+                            t[i] ^= s[i];
+                    (*this)();
+                }
+            }
+            for (int i = 0; i < 4; ++i)
+                s[i] = t[i];
+        }
+
+        /**
+         * \brief Split off a generator for a separate thread.
+         *
+         * The returned generator continues this sequence, while this
+         * generator jumps 2^128 steps ahead, so the two never overlap.
+         */
+        constexpr xoshiro256ss split() {
+            xoshiro256ss child = *this;
+            jump();
+            return child;
+        }
+
+        static constexpr uint64_t min() { return 0; }
+        static constexpr uint64_t max() { return std::numeric_limits<uint64_t>::max(); }
+    };
+
+    /**
+     * \brief Uniform integer in [0, bound), without modulo bias (Lemire).
+     */
+    template<typename G>
+    constexpr uint64_t below(G &g, uint64_t bound) {
+        uint64_t x = g();
+        __uint128_t m = __uint128_t(x) * bound;
+        uint64_t l = uint64_t(m);
+        if (l < bound) {
+            uint64_t t = -bound % bound;
+            while (l < t) {
+                x = g();
+                m = __uint128_t(x) * bound;
+                l = uint64_t(m);
+            }
+        }
+        return uint64_t(m >> 64);
+    }
+
+    /**
+     * \brief Uniform real number in [0, 1).
+     */
+    template<typename T, typename G>
+    constexpr T canonical(G &g) {
+        // Use the top mantissa-many bits.
+        constexpr int bits = std::numeric_limits<T>::digits;
+        return T(g() >> (64 - bits)) * (T(1) / T(uint64_t(1) << bits));
+    }
+
+    /**
+     * \brief Uniform real number in [lo, hi).
+     */
+    template<typename T, typename G>
+    constexpr T uniform(G &g, T lo, T hi) {
+        return lo + (hi - lo) * canonical<T>(g);
+    }
+}
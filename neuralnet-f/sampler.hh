@@ -0,0 +1,134 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief The order in which training records are visited.
+ *
+ * A sampler produces a list of record numbers for each epoch. Records
+ * themselves are never moved or copied.
+ */
+
+#include "common.hh"
+#include "idx_file.hh"
+#include "rng.hh"
+#include <algorithm>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+namespace idx {
+
+    enum class sampling {
+        sequential,  ///< File order, every epoch.
+        shuffle,     ///< A new permutation every epoch.
+        stratified,  ///< A new permutation with classes spread evenly over the epoch.
+        replacement, ///< Records drawn independently, with replacement.
+    };
+
+    /**
+     * \brief Fisher-Yates shuffle.
+     */
+    template<typename T, typename G>
+    void shuffle(T *first, size_t n, G &g) {
+        for (size_t i = n; i > 1; --i)
+            std::swap(first[i-1], first[rng::below(g, i)]);
+    }
+
+    class sampler {
+        sampling mode;
+        uint64_t seed;
+        size_t   n;
+
+        // Record numbers grouped per class, for stratified sampling.
+        std::vector<std::vector<uint32_t>> classes;
+
+    public:
+        /**
+         * \param labels Label file, one class number per record.
+         * \param mode   How to order records.
+         * \param seed   Every (seed, epoch) pair gives the same order on every run.
+         */
+        sampler(const file &labels,
+                sampling mode = sampling::sequential,
+                uint64_t seed = 0)
+            : mode(mode),
+              seed(seed),
+              n(labels.count()) {
+
+            if (mode == sampling::stratified) {
+                auto label = labels.elements<uint8_t>();
+                for (size_t i = 0; i < n; ++i) {
+                    if (label[i] >= classes.size())
+                        classes.resize(label[i] + 1);
+                    classes[label[i]].push_back(i);
+                }
+            }
+        }
+
+        /// Amount of records per epoch.
+        size_t size() const { return n; }
+
+        /**
+         * \brief Fill `order` with the record numbers to visit in epoch `e`.
+         *
+         * Each epoch has its own random stream, so epochs can be generated
+         * in any order, on any thread.
+         */
+        void epoch(uint64_t e, std::vector<uint32_t> &order) const {
+            rng::xoshiro256ss g(seed, e);
+            order.resize(n);
+
+            switch (mode) {
+            case sampling::sequential:
+                std::iota(order.begin(), order.end(), 0);
+                break;
+
+            case sampling::shuffle:
+                std::iota(order.begin(), order.end(), 0);
+                shuffle(order.data(), n, g);
+                break;
+
+            case sampling::replacement:
+                for (auto &i : order)
+                    i = rng::below(g, n);
+                break;
+
+            case sampling::stratified: {
+                // Shuffle each class, then merge the classes such that
+                // record i of a class with c records lands at about i/c
+                // of the way through the epoch. Every batch then gets
+                // about its share of every class.
+                std::vector<std::pair<double,uint32_t>> keyed;
+                keyed.reserve(n);
+                for (const auto &c : classes) {
+                    std::vector<uint32_t> members = c;
+                    shuffle(members.data(), members.size(), g);
+                    double offset = rng::canonical<double>(g);
+                    for (size_t i = 0; i < members.size(); ++i)
+                        keyed.emplace_back((i + offset) / members.size(), members[i]);
+                }
+                std::sort(keyed.begin(), keyed.end());
+                for (size_t i = 0; i < n; ++i)
+                    order[i] = keyed[i].second;
+                break;
+            }
+            }
+        }
+    };
+}
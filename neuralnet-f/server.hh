@@ -0,0 +1,419 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief Serving a trained net.
+ *
+ * Requests for single samples are collected into batches: a batch is
+ * run as soon as it is full, or when its oldest request has waited for
+ * `max_wait`. Under load this gives the throughput of full batches,
+ * while a lone request is answered within `max_wait` plus the time of
+ * one forward pass.
+ *
+ * The wire protocol (stdin/stdout, or a Unix socket) is line based:
+ *
+ *     request:  <inputs> numbers, separated by spaces or commas
+ *     response: <class> <output 1> ... <output n>
+ *               or "error: <message>"
+ *
+ * Requests may be pipelined; responses come in request order.
+ */
+
+#include "common.hh"
+#include "matrix.hh"
+#include "nn.hh"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace serve {
+
+    using clock = std::chrono::steady_clock;
+
+    /**
+     * \brief Latency and throughput of served requests.
+     */
+    class stats {
+        mutable std::mutex  mutex;
+        std::vector<double> latencies; // In microseconds.
+        size_t              batches = 0;
+        clock::time_point   first, last;
+
+    public:
+        void record(clock::time_point arrived, clock::time_point answered) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (latencies.empty())
+                first = arrived;
+            last = std::max(last, answered);
+            latencies.push_back(std::chrono::duration<double,std::micro>(answered - arrived).count());
+        }
+
+        void batch() {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++batches;
+        }
+
+        void report(std::ostream &os) const {
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t n = latencies.size();
+            if (!n) {
+                os << "no requests served\n";
+                return;
+            }
+            std::vector<double> l = latencies;
+            auto percentile = [&](double p) {
+                auto it = l.begin() + std::min(n - 1, size_t(p * n));
+                std::nth_element(l.begin(), it, l.end());
+                return *it;
+            };
+            double seconds = std::chrono::duration<double>(last - first).count();
+
+            os << n << " requests in " << batches << " batches"
+               << " (" << double(n) / batches << " per batch)\n"
+               << "latency p50: " << percentile(0.50) << " us, "
+               <<         "p99: " << percentile(0.99) << " us\n"
+               << "throughput: " << (seconds > 0 ? n / seconds : 0) << " requests/s\n";
+        }
+    };
+
+    /**
+     * \brief Collects single samples into batches for nn::forwards.
+     *
+     * \tparam batch_size The largest batch to run at once.
+     * \tparam Net        A net made with nn::make_net, or a tuple of
+     *                    views on one (e.g. checkpoint::mapped::net()).
+     *                    It must outlive the batcher.
+     * \tparam Output     The kind of output layer the net was trained with.
+     */
+    template<uint batch_size, typename Net, typename Output = nn::sigmoid_mse>
+    class batcher {
+    public:
+        using value_type = typename std::tuple_element_t<0, Net>::value_type;
+
+        static constexpr uint inputs  = nn::net_inputs<Net>;
+        static constexpr uint outputs = std::tuple_element_t<std::tuple_size<Net>::value - 1, Net>::ncols;
+
+        using input_type  = std::array<value_type, inputs>;
+        using output_type = std::array<value_type, outputs>;
+
+    private:
+        struct request {
+            input_type                 x;
+            std::promise<output_type>  answer;
+            clock::time_point          arrived;
+        };
+
+        const Net           &net;
+        clock::duration      max_wait;
+        serve::stats         stats_;
+
+        std::mutex                mutex;
+        std::condition_variable   ready;
+        std::deque<request>       queue;
+        bool                      stopping = false;
+
+        std::thread worker;
+
+        void run() {
+            // Rows of a partial batch past the last request stay zero.
+            auto X = std::make_unique<Matrix<value_type,batch_size,inputs>>();
+            std::vector<request> work;
+            work.reserve(batch_size);
+
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [&] { return stopping || !queue.empty(); });
+                    if (queue.empty())
+                        return;
+                    ready.wait_until(lock, queue.front().arrived + max_wait, [&] {
+                            return stopping || queue.size() >= batch_size;
+                        });
+
+                    size_t n = std::min<size_t>(queue.size(), batch_size);
+                    std::move(queue.begin(), queue.begin() + n, std::back_inserter(work));
+                    queue.erase(queue.begin(), queue.begin() + n);
+                }
+
+                for (size_t r = 0; r < work.size(); ++r)
+                    std::copy(work[r].x.begin(), work[r].x.end(), X->data() + r * inputs);
+
+                auto A = std::apply([&](const auto&...W) { return nn::forwards<Output>(*X, W...); }, net);
+                stats_.batch();
+
+                auto answered = clock::now();
+                for (size_t r = 0; r < work.size(); ++r) {
+                    output_type y;
+                    std::copy(A.data() + r * outputs, A.data() + (r + 1) * outputs, y.begin());
+                    stats_.record(work[r].arrived, answered);
+                    work[r].answer.set_value(y);
+                }
+
+                std::fill(X->data(), X->data() + work.size() * inputs, value_type(0));
+                work.clear();
+            }
+        }
+
+    public:
+        /**
+         * \param max_wait The longest a request waits for its batch to fill up.
+         */
+        explicit batcher(const Net &net, clock::duration max_wait = std::chrono::milliseconds(1))
+            : net(net),
+              max_wait(max_wait),
+              worker([this] { run(); })
+            { }
+
+        /// Answers all pending requests before returning.
+        ~batcher() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            ready.notify_all();
+            worker.join();
+        }
+
+        batcher(const batcher&) = delete;
+        batcher &operator=(const batcher&) = delete;
+
+        /**
+         * \brief Queue one sample.
+         *
+         * The future becomes ready when the batch it ends up in has been run.
+         */
+        std::future<output_type> submit(const input_type &x) {
+            std::future<output_type> f;
+            bool wake;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queue.push_back(request { x, { }, clock::now() });
+                f = queue.back().answer.get_future();
+                // The worker only needs waking for the first request of a
+                // batch and for the one that fills it.
+                wake = queue.size() == 1 || queue.size() == batch_size;
+            }
+            if (wake)
+                ready.notify_one();
+            return f;
+        }
+
+        const serve::stats &stats() const { return stats_; }
+    };
+
+    namespace detail {
+
+        /// Parse one request line. Returns false if it does not hold exactly N numbers.
+        template<typename T, size_t N>
+        bool parse(const char *line, std::array<T,N> &x) {
+            size_t i = 0;
+            for (const char *p = line; ; ) {
+                while (*p == ' ' || *p == '\t' || *p == ',' || *p == '\r' || *p == '\n')
+                    ++p;
+                if (!*p)
+                    break;
+                char *end;
+                double v = std::strtod(p, &end);
+                if (end == p || i == N)
+                    return false;
+                x[i++] = T(v);
+                p = end;
+            }
+            return i == N;
+        }
+    }
+
+    /**
+     * \brief Answer requests read from `in` on `out`, until `in` ends.
+     *
+     * Reading and writing happen on separate threads, so a client can
+     * send many requests before reading any answers and have them
+     * batched together.
+     */
+    template<typename B>
+    void serve_stream(B &batcher, int in, int out) {
+        using output_type = typename B::output_type;
+
+        // A request's answer, or the reason there is none.
+        struct pending {
+            std::future<output_type> answer;
+            std::string              error;
+        };
+
+        std::mutex              mutex;
+        std::condition_variable more;
+        std::deque<pending>     answers;
+        bool                    done = false;
+
+        std::thread writer([&] {
+            FILE *f = fdopen(dup(out), "w");
+            if (!f)
+                return;
+            for (;;) {
+                pending p;
+                bool    last;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    more.wait(lock, [&] { return done || !answers.empty(); });
+                    if (answers.empty())
+                        break;
+                    p = std::move(answers.front());
+                    answers.pop_front();
+                    last = answers.empty();
+                }
+                if (p.error.empty()) {
+                    output_type y = p.answer.get();
+                    auto best = std::max_element(y.begin(), y.end()) - y.begin();
+                    std::fprintf(f, "%d", int(best));
+                    for (auto v : y)
+                        std::fprintf(f, " %.6g", double(v));
+                    std::fputc('\n', f);
+                } else {
+                    std::fprintf(f, "error: %s\n", p.error.c_str());
+                }
+                // Flush once the answers that are known so far have been written.
+                if (last)
+                    std::fflush(f);
+            }
+            std::fclose(f);
+        });
+
+        FILE  *f    = fdopen(dup(in), "r");
+        char  *line = nullptr;
+        size_t cap  = 0;
+        typename B::input_type x;
+
+        while (f && getline(&line, &cap, f) >= 0) {
+            pending p;
+            if (detail::parse(line, x))
+                p.answer = batcher.submit(x);
+            else
+                p.error = "expected " + std::to_string(B::inputs) + " numbers";
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                answers.push_back(std::move(p));
+            }
+            more.notify_one();
+        }
+        std::free(line);
+        if (f)
+            std::fclose(f);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        more.notify_one();
+        writer.join();
+    }
+
+    /**
+     * \brief Accept connections on a Unix socket until `stop` is set.
+     *
+     * Every connection is served by serve_stream() on its own threads,
+     * all sharing one batcher. An existing socket file at `path` is
+     * replaced; any other kind of file there is left alone, and is an
+     * error.
+     */
+    template<typename B>
+    void serve_unix(B &batcher, std::string_view path, const std::atomic<bool> &stop) {
+        sockaddr_un addr { };
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof addr.sun_path)
+            throw std::runtime_error("Socket path is too long");
+        std::memcpy(addr.sun_path, path.data(), path.size());
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            throw std::runtime_error("Could not create socket");
+        struct stat st;
+        if (::lstat(addr.sun_path, &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) {
+                ::close(fd);
+                throw std::runtime_error("Address in use: " + std::string(path) + " is not a socket");
+            }
+            ::unlink(addr.sun_path);
+        }
+        if (::bind(fd, (sockaddr*)&addr, sizeof addr) < 0 || ::listen(fd, 64) < 0) {
+            ::close(fd);
+            throw std::runtime_error("Could not listen on " + std::string(path));
+        }
+
+        // Connection threads are detached; `connections` holds one entry
+        // per live thread, so that shutdown can wait for them.
+        std::mutex              mutex;
+        std::condition_variable gone;
+        std::vector<int>        connections;
+
+        while (!stop) {
+            // Wake up now and then to check `stop`.
+            pollfd p { fd, POLLIN, 0 };
+            if (::poll(&p, 1, 100) <= 0)
+                continue;
+            int c = ::accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (c < 0)
+                continue;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                connections.push_back(c);
+            }
+            std::thread([&, c] {
+                serve_stream(batcher, c, c);
+                std::unique_lock<std::mutex> lock(mutex);
+                connections.erase(std::find(connections.begin(), connections.end(), c));
+                ::close(c);
+                // Only wakes the wait below once this thread is gone.
+                std::notify_all_at_thread_exit(gone, std::move(lock));
+            }).detach();
+        }
+
+        // End the requests of clients that are still connected.
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (int c : connections)
+                ::shutdown(c, SHUT_RD);
+            gone.wait(lock, [&] { return connections.empty(); });
+        }
+
+        ::close(fd);
+        ::unlink(addr.sun_path);
+    }
+}
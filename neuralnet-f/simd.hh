@@ -0,0 +1,279 @@
+/* neuralnet-f - Algebraic (vectorized) neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * \file
+ * \brief Element-wise SIMD kernels.
+ *
+ * Kernels are written once against GCC/Clang vector extension types,
+ * whose width is picked at compile time from the target ISA
+ * (AVX-512, AVX/AVX2, SSE2/NEON, or a scalar fallback).
+ *
+ * Functions that are safe to call with a whole vector of elements are
+ * marked by wrapping them in simd::vectorized(); everything else is
+ * applied one element at a time.
+ *
+ * Vector types cannot be used in constant expressions; when evaluated
+ * at compile time, the kernels below take their scalar paths instead.
+ */
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace simd {
+
+    /**
+     * \brief Whether the caller is being evaluated at compile time.
+     *
+     * This is std::is_constant_evaluated(), which C++17 lacks.
+     */
+    constexpr bool constant_evaluated() { return __builtin_is_constant_evaluated(); }
+
+    /// Width of a SIMD register in bytes.
+    #if defined(MATRIX_NO_SIMD)
+    constexpr size_t bytes = 8;
+    #elif defined(__AVX512F__)
+    constexpr size_t bytes = 64;
+    #elif defined(__AVX__)
+    constexpr size_t bytes = 32;
+    #elif defined(__SSE2__) || defined(__ARM_NEON)
+    constexpr size_t bytes = 16;
+    #else
+    constexpr size_t bytes = 8;
+    #endif
+
+    /// Whether there is a vector type for T.
+    template<typename T>
+    constexpr bool supported = std::is_same<T,float>::value
+                            || std::is_same<T,double>::value;
+
+    /// Amount of T elements per vector.
+    template<typename T>
+    constexpr size_t width = bytes / sizeof(T) ? bytes / sizeof(T) : 1;
+
+    template<typename T>
+    struct vec_of {
+        typedef T type __attribute__((vector_size(width<T> * sizeof(T))));
+    };
+
+    /// A vector of T.
+    template<typename T>
+    using vec = typename vec_of<T>::type;
+
+    /// Element type of a vector.
+    template<typename V>
+    using element_t = std::remove_cv_t<std::remove_reference_t<decltype(std::declval<V>()[0])>>;
+
+    template<typename V>
+    inline V load(const element_t<V> *p) {
+        V v;
+        __builtin_memcpy(&v, p, sizeof v);
+        return v;
+    }
+
+    template<typename V>
+    inline void store(element_t<V> *p, V v) {
+        __builtin_memcpy(p, &v, sizeof v);
+    }
+
+    template<typename V>
+    inline V splat(element_t<V> x) { return V { } + x; }
+
+    /**
+     * \brief Marks a function object as callable with vectors.
+     */
+    template<typename F>
+    struct vectorized : F {
+        constexpr vectorized(F f) : F(f) { }
+        using F::operator();
+    };
+
+    template<typename F>
+    struct is_vectorized : std::false_type { };
+    template<typename F>
+    struct is_vectorized<vectorized<F>> : std::true_type { };
+
+    namespace detail {
+
+        template<typename T> struct exp_consts;
+
+        template<> struct exp_consts<double> {
+            using I = int64_t;
+            static constexpr double lo = -708.3, hi = 708.3;
+            static constexpr int mantissa = 52, bias = 1023, degree = 13;
+        };
+        template<> struct exp_consts<float> {
+            using I = int32_t;
+            static constexpr float lo = -87.3f, hi = 88.3f;
+            static constexpr int mantissa = 23, bias = 127, degree = 7;
+        };
+
+        /// Taylor coefficients of exp around zero: c[k] = 1/k!
+        template<typename T, int N>
+        struct taylor_coefficients {
+            T c[N+1] { };
+            constexpr taylor_coefficients() {
+                T f = 1;
+                for (int k = 0; k <= N; ++k) {
+                    if (k)
+                        f *= k;
+                    c[k] = 1 / f;
+                }
+            }
+        };
+        template<typename T, int N>
+        constexpr taylor_coefficients<T,N> taylor { };
+
+        template<typename V>
+        inline V exp(V x) {
+            using T = element_t<V>;
+            using C = exp_consts<T>;
+            typedef typename C::I I __attribute__((vector_size(sizeof(V))));
+
+            constexpr T log2e  = 1.44269504088896340736;
+            constexpr T ln2_hi = 0.693145751953125;
+            constexpr T ln2_lo = 1.42860682030941723212e-6;
+
+            x = x < C::lo ? splat<V>(C::lo) : x;
+            x = x > C::hi ? splat<V>(C::hi) : x;
+
+            // x = n ln2 + r, with |r| <= ln2/2.
+            V fx = x * log2e;
+            I n  = __builtin_convertvector(fx + (fx < 0 ? splat<V>(-0.5) : splat<V>(0.5)), I);
+            V nf = __builtin_convertvector(n, V);
+            V r  = x - nf * ln2_hi - nf * ln2_lo;
+
+            // exp(r), Taylor series in Horner form.
+            V p = splat<V>(taylor<T,C::degree>.c[C::degree]);
+            for (int k = C::degree - 1; k >= 0; --k)
+                p = p * r + taylor<T,C::degree>.c[k];
+
+            // 2^n, by building the exponent directly.
+            I bits = (n + C::bias) << C::mantissa;
+            return p * (V)bits;
+        }
+
+        /// exp for scalars, the same way, usable in constant expressions.
+        template<typename T>
+        constexpr T exp_scalar(T x) {
+            using C = exp_consts<T>;
+
+            constexpr T log2e  = 1.44269504088896340736;
+            constexpr T ln2_hi = 0.693145751953125;
+            constexpr T ln2_lo = 1.42860682030941723212e-6;
+
+            x = x < C::lo ? C::lo : x;
+            x = x > C::hi ? C::hi : x;
+
+            T   fx = x * log2e;
+            int n  = int(fx + (fx < 0 ? T(-0.5) : T(0.5)));
+            T   r  = x - T(n) * ln2_hi - T(n) * ln2_lo;
+
+            T p = taylor<T,C::degree>.c[C::degree];
+            for (int k = C::degree - 1; k >= 0; --k)
+                p = p * r + taylor<T,C::degree>.c[k];
+
+            // 2^n, by squaring (exact: every factor is a power of two).
+            T b = n < 0 ? T(0.5) : T(2);
+            for (unsigned e = n < 0 ? -n : n; e; e >>= 1, b *= b)
+                if (e & 1)
+                    p *= b;
+            return p;
+        }
+    }
+
+    /**
+     * \brief Fast exponential, for scalars and vectors.
+     *
+     * Within about 1 ulp of the correctly rounded result (measured: 1.0 ulp
+     * for double, 0.9 for float) over the range that does not over- or
+     * underflow; arguments outside of that range are clamped.
+     */
+    template<typename X>
+    constexpr X exp(X x) {
+        if constexpr (std::is_arithmetic<X>::value) {
+            if (constant_evaluated())
+                return detail::exp_scalar(x);
+            return detail::exp(splat<vec<X>>(x))[0];
+        } else {
+            return detail::exp(x);
+        }
+    }
+
+    /**
+     * \brief Square root, for scalars and vectors.
+     */
+    template<typename X>
+    inline X sqrt(X x) {
+        if constexpr (std::is_arithmetic<X>::value) {
+            return std::sqrt(x);
+        } else {
+            // The compiler turns this into one vector instruction.
+            for (size_t i = 0; i < sizeof x / sizeof x[0]; ++i)
+                x[i] = std::sqrt(x[i]);
+            return x;
+        }
+    }
+
+    namespace detail {
+        template<typename T, typename F, typename... In, size_t... Is>
+        inline void transform_tail(size_t n, T *out, const F &f,
+                                   std::index_sequence<Is...>,
+                                   const In *...in) {
+            // Pad the last few elements to a full vector.
+            T buf[sizeof...(In) + 1][width<T>] = { };
+            (__builtin_memcpy(buf[Is], in, n * sizeof(T)), ...);
+            store(buf[sizeof...(In)], f(load<vec<T>>(buf[Is])...));
+            __builtin_memcpy(out, buf[sizeof...(In)], n * sizeof(T));
+        }
+    }
+
+    /**
+     * \brief Apply f element-wise: out[i] = f(in[i]...).
+     *
+     * Any of the `in` pointers may be equal to `out`.
+     */
+    template<typename T, typename F, typename... In>
+    constexpr void transform(size_t n, T *out, const F &f, const In *...in) {
+        static_assert((std::is_same<T,In>::value && ...),
+                      "transform operands must have the same element type");
+
+        if (constant_evaluated()) {
+            for (size_t i = 0; i < n; ++i)
+                out[i] = f(in[i]...);
+        } else if constexpr (supported<T> && is_vectorized<F>::value) {
+            using V = vec<T>;
+            constexpr size_t W = width<T>;
+
+            size_t i = 0;
+            for (; i + W <= n; i += W)
+                store(out + i, f(load<V>(in + i)...));
+
+            if (i < n)
+                detail::transform_tail(n - i, out + i, f,
+                                       std::index_sequence_for<In...> { },
+                                       (in + i)...);
+        } else {
+            for (size_t i = 0; i < n; ++i)
+                out[i] = f(in[i]...);
+        }
+    }
+}
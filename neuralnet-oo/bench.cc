@@ -0,0 +1,320 @@
+/* neuralnet-oo - Object oriented neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Benchmarks of Net::run and Net::train, for the nets in main.cc and
+// for the MNIST net of neuralnet-f (784-4x30-10).
+//
+//     bench [--filter=<substring>] [--min-time=<seconds>] [--threads=<n>] [--json]
+//
+// With more than one thread, the nets get a ThreadPool of that size
+// (see Net::setThreadPool), which only the MNIST net is big enough for.
+//
+// The output is that of neuralnet-f's bench (see there), so that the
+// two can be compared. Per sample:
+//
+// - FLOP:  two per link for a run, six for training (forward, delta,
+//          weight update).
+// - bytes: every weight (and the value of its source) is read once
+//          per run; training reads it twice (forward, backward) and
+//          writes it back, along with the delta of its source.
+//
+// Global operator new is replaced to count heap allocations. run and
+// train must not allocate once a net has been compiled: bench exits
+// with status 2 if any of their benchmarks did.
+//
+// The nets of main.cc all use the sigmoid. The other activation
+// policies are benchmarked on a small net as well, and must be able to
+// learn XOR with it: bench exits with status 3 if one could not.
+
+#include "common.hh"
+#include "net.hh"
+#include "pool.hh"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace {
+    size_t allocations = 0;
+}
+
+void *operator new(size_t n) {
+    ++allocations;
+    if (void *p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept         { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+    struct result {
+        std::string name;
+        size_t      iterations;
+        double      seconds;  ///< Per iteration.
+        double      flop;     ///< Per iteration.
+        double      bytes;    ///< Per iteration.
+        uint        samples;  ///< Per iteration.
+        double      allocations; ///< Per iteration.
+    };
+
+    struct {
+        std::string filter;
+        double      min_time = 0.2;
+        bool        json     = false;
+        uint        threads  = 1;
+    } options;
+
+    nn::ThreadPool *pool = nullptr;
+
+    std::vector<result> results;
+
+    template<typename F>
+    void measure(const std::string &name, double flop, double bytes, uint samples, F f) {
+        if (!options.filter.empty() && name.find(options.filter) == std::string::npos)
+            return;
+
+        using clock = std::chrono::steady_clock;
+        f(); // warm up.
+        size_t n = 1;
+        for (;;) {
+            size_t a0 = allocations;
+            auto   t0 = clock::now();
+            for (size_t i = 0; i < n; ++i)
+                f();
+            std::chrono::duration<double> dt = clock::now() - t0;
+            size_t a = allocations - a0;
+            if (dt.count() > options.min_time) {
+                results.push_back({ name, n, dt.count() / n, flop, bytes, samples, double(a) / n });
+                break;
+            }
+            n *= 2;
+        }
+
+        if (!options.json) {
+            const result &r = results.back();
+            std::printf("%-44s %12.0f ns  %7.2f GFLOP/s  %10.0f bytes  %9.1f ns/sample  %g allocs\n",
+                        r.name.c_str(), r.seconds * 1e9, r.flop / r.seconds / 1e9,
+                        r.bytes, r.seconds * 1e9 / r.samples, r.allocations);
+        }
+    }
+
+    void report_json() {
+        char date[32];
+        std::time_t now = std::time(nullptr);
+        std::strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%S%z", std::localtime(&now));
+
+        std::printf("{\n"
+                    "  \"context\": {\n"
+                    "    \"date\": \"%s\",\n"
+                    "    \"executable\": \"neuralnet-oo/bench\",\n"
+                    "    \"compiler\": \"%s\"\n"
+                    "  },\n"
+                    "  \"benchmarks\": [",
+                    date, __VERSION__);
+
+        for (size_t i = 0; i < results.size(); ++i) {
+            const result &r = results[i];
+            std::printf("%s\n    {\n"
+                        "      \"name\": \"%s\",\n"
+                        "      \"run_type\": \"iteration\",\n"
+                        "      \"iterations\": %zu,\n"
+                        "      \"real_time\": %.3f,\n"
+                        "      \"time_unit\": \"ns\",\n"
+                        "      \"flop\": %.0f,\n"
+                        "      \"FLOP/s\": %.6e,\n"
+                        "      \"bytes\": %.0f,\n"
+                        "      \"bytes_per_second\": %.6e,\n"
+                        "      \"samples\": %u,\n"
+                        "      \"ns_per_sample\": %.3f,\n"
+                        "      \"allocations\": %g\n"
+                        "    }",
+                        i ? "," : "",
+                        r.name.c_str(), r.iterations, r.seconds * 1e9,
+                        r.flop, r.flop / r.seconds,
+                        r.bytes, r.bytes / r.seconds,
+                        r.samples, r.seconds * 1e9 / r.samples, r.allocations);
+        }
+        std::printf("\n  ]\n}\n");
+    }
+
+    template<typename Net>
+    size_t links(const Net &net) {
+        size_t n = 0;
+        for (const auto &layer : net.getLayers())
+            for (const auto &neuron : layer)
+                n += neuron.getInputs().size();
+        return n;
+    }
+
+    /**
+     * \brief Run and train a net on `samples` random records, one at a time.
+     *
+     * \param policy The name of Policy in the benchmark names, empty for
+     *               the sigmoid.
+     */
+    template<typename Policy = nn::SigmoidActivationPolicy>
+    void bench_net(uint inputs, uint outputs, uint hidden, uint neurons, uint samples,
+                   const std::string &policy = "") {
+        using T   = double;
+        using Net = nn::Net<T, Policy>;
+
+        Net net(inputs, outputs, hidden, neurons);
+        net.setThreadPool(pool);
+
+        std::vector<std::vector<T>> X(samples, std::vector<T>(inputs));
+        std::vector<std::vector<T>> Y(samples, std::vector<T>(outputs));
+        std::vector<T> y(outputs);
+        for (uint s = 0; s < samples; ++s) {
+            for (auto &x : X[s])
+                x = (T)rand() / RAND_MAX;
+            Y[s][s % outputs] = 1;
+        }
+
+        std::string shape = "f64/" + (policy.empty() ? "" : policy + "/") + std::to_string(inputs)
+                          + "-" + std::to_string(hidden) + "x" + std::to_string(neurons)
+                          + "-" + std::to_string(outputs);
+
+        double n    = double(links(net));
+        double link = 2 * sizeof(T);
+
+        measure("run/" + shape, 2 * n * samples, link * n * samples, samples, [&] {
+            for (uint s = 0; s < samples; ++s)
+                net.run(X[s], y);
+        });
+        measure("train/" + shape, 6 * n * samples, 3 * link * n * samples, samples, [&] {
+            for (uint s = 0; s < samples; ++s)
+                net.train(X[s], Y[s]);
+        });
+
+        // One epoch in batches of four; this allocates only the result.
+        std::vector<typename Net::Example> data;
+        for (uint s = 0; s < samples; ++s)
+            data.push_back({ X[s], Y[s] });
+
+        measure("fit/b4/" + shape, 6 * n * samples, 3 * link * n * samples, samples, [&] {
+            net.fit(data, 1, 4);
+        });
+    }
+
+    std::vector<std::string> unlearned;
+
+    /**
+     * \brief Check that a 2-8-1 net with the given activation learns XOR.
+     *
+     * A ReLU net can start out with neurons that are dead for every
+     * input and never recover, so each policy gets a few fresh nets.
+     */
+    template<typename Policy>
+    void learn_xor(const std::string &policy) {
+        using T = double;
+
+        std::string name = "learn/xor/" + policy;
+        if (!options.filter.empty() && name.find(options.filter) == std::string::npos)
+            return;
+
+        const std::vector<std::vector<T>> X { { 0, 0 }, { 0, 1 }, { 1, 0 }, { 1, 1 } };
+        const std::vector<std::vector<T>> Y { { 0 }, { 1 }, { 1 }, { 0 } };
+        std::vector<T> y(1);
+
+        constexpr uint tries = 10;
+        for (uint i = 1; i <= tries; ++i) {
+            nn::Net<T, Policy> net(2, 1, 1, 8);
+            net.setThreadPool(pool);
+            for (uint epoch = 0; epoch < 5000; ++epoch)
+                for (uint s = 0; s < X.size(); ++s)
+                    net.train(X[s], Y[s]);
+
+            bool learned = true;
+            for (uint s = 0; s < X.size(); ++s) {
+                net.run(X[s], y);
+                learned = learned && std::fabs(y[0] - Y[s][0]) < 0.2;
+            }
+            if (learned) {
+                if (!options.json)
+                    std::printf("%-44s learned in %u of %u nets\n", name.c_str(), i, tries);
+                return;
+            }
+        }
+        unlearned.push_back(name);
+    }
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strncmp(argv[i], "--filter=", 9)) {
+            options.filter = argv[i] + 9;
+        } else if (!std::strncmp(argv[i], "--min-time=", 11)) {
+            options.min_time = std::stod(argv[i] + 11);
+        } else if (!std::strncmp(argv[i], "--threads=", 10)) {
+            options.threads = std::stoul(argv[i] + 10);
+        } else if (!std::strcmp(argv[i], "--json")) {
+            options.json = true;
+        } else {
+            std::fprintf(stderr, "usage: %s [--filter=<substring>] [--min-time=<seconds>] [--threads=<n>] [--json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    nn::ThreadPool threads(options.threads);
+    if (threads.size() > 1)
+        pool = &threads;
+
+    srand(1);
+
+    // Half adder, 3-way XOR and divisible-by-three of main.cc.
+    bench_net(  2,  2, 1,  2,   4);
+    bench_net(  3,  1, 2,  4,   8);
+    bench_net(  6,  1, 1,  5,  64);
+
+    // The MNIST net of neuralnet-f.
+    bench_net(784, 10, 4, 30, 100);
+
+    // The other activation policies.
+    bench_net<nn::TanhActivationPolicy>       (2, 1, 1, 8, 4, "tanh");
+    bench_net<nn::ReluActivationPolicy>       (2, 1, 1, 8, 4, "relu");
+    bench_net<nn::LeakyReluActivationPolicy<>>(2, 1, 1, 8, 4, "leaky_relu");
+
+    learn_xor<nn::SigmoidActivationPolicy>    ("sigmoid");
+    learn_xor<nn::TanhActivationPolicy>       ("tanh");
+    learn_xor<nn::ReluActivationPolicy>       ("relu");
+    learn_xor<nn::LeakyReluActivationPolicy<>>("leaky_relu");
+
+    if (options.json)
+        report_json();
+
+    for (const auto &r : results) {
+        if (r.allocations && r.name.compare(0, 4, "fit/")) {
+            std::fprintf(stderr, "%s: %g heap allocations per iteration\n",
+                         r.name.c_str(), r.allocations);
+            return 2;
+        }
+    }
+
+    for (const auto &name : unlearned)
+        std::fprintf(stderr, "%s: no net learned XOR\n", name.c_str());
+    if (!unlearned.empty())
+        return 3;
+
+    return 0;
+}
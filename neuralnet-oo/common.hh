@@ -18,6 +18,10 @@
 
 #include <vector>
 #include <cstdint>
+#include <cstddef>
+#include <initializer_list>
+#include <type_traits>
+#include <utility>
 
 template<typename S, typename T>
 S &operator<<(S& s, const std::vector<T> &v) {
@@ -32,6 +36,58 @@ S &operator<<(S& s, const std::vector<T> &v) {
 
 #include <cmath>
 
+namespace nn {
+
+    /**
+     * \brief A view on a contiguous array of Ts owned by someone else.
+     *
+     * Made from a pointer and a size, from anything with data() and
+     * size() (like std::vector), or, for a span<const T> that is passed
+     * as an argument, from a braced list of values or a temporary
+     * container.
+     */
+    template<typename T>
+    class span {
+        T     *data_ = nullptr;
+        size_t size_ = 0;
+
+    public:
+        span() = default;
+        span(T *data, size_t size)
+            : data_(data),
+              size_(size)
+            { }
+
+        template<typename C,
+                 typename = std::enable_if_t<std::is_convertible<decltype(std::declval<C&>().data()), T*>::value>>
+        span(C &c)
+            : data_(c.data()),
+              size_(c.size())
+            { }
+
+        /// A temporary only lives until the end of the full expression.
+        template<typename C,
+                 typename = std::enable_if_t<std::is_convertible<decltype(std::declval<const C&>().data()), T*>::value>>
+        span(const C &c)
+            : data_(c.data()),
+              size_(c.size())
+            { }
+
+        /// The list only lives until the end of the full expression.
+        span(std::initializer_list<std::remove_const_t<T>> l)
+            : data_(std::begin(l)),
+              size_(l.size())
+            { }
+
+        T     *data()  const { return data_; }
+        size_t size()  const { return size_; }
+        T     *begin() const { return data_; }
+        T     *end()   const { return data_ + size_; }
+
+        T &operator[](size_t i) const { return data_[i]; }
+    };
+}
+
 // Uncomment to round all floats before printing.
 //
 // template<typename S>
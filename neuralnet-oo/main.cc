@@ -22,6 +22,7 @@
 #include <fstream>
 #include <random>
 #include <algorithm>
+#include <array>
 
 using namespace nn;
 
@@ -276,26 +277,31 @@ void iris_dataset() {
     // std::cout << "<<<\n" << test_data << "<<<\n";
     // std::cout << "<<<\n" << data << "<<<\n";
     // train network
-    for (int i = 0; i < 10000; i++) {
-        for (const auto &d: data) {
-            net.train({ d.sepal_l,
-                        d.sepal_w,
-                        d.petal_l,
-                        d.petal_w },
-                      { static_cast<IrisType>(d.i == Iris::setosa),
-                        static_cast<IrisType>(d.i == Iris::versicolor),
-                        static_cast<IrisType>(d.i == Iris::virginica) });
-        }
-        //std::cout << "trained round " << i + 1 << " of 10000\n";
-    }
+    std::vector<Net<IrisType>::Example> examples;
+    for (const auto &d: data)
+        examples.push_back({ { d.sepal_l,
+                               d.sepal_w,
+                               d.petal_l,
+                               d.petal_w },
+                             { static_cast<IrisType>(d.i == Iris::setosa),
+                               static_cast<IrisType>(d.i == Iris::versicolor),
+                               static_cast<IrisType>(d.i == Iris::virginica) } });
+
+    // Hold back a fifth of the training data to know when to stop.
+    auto fit = net.fit(examples, 10000, 1, { 0.2, 200 });
+    std::cout << "\nTrained " << fit.loss.size() << " rounds, best was round " << fit.best;
+    if (!fit.validationLoss.empty())
+        std::cout << " (validation loss " << fit.validationLoss[fit.best - 1] << ")";
+
     std::cout << "\nNetwork is done:\n" << net << "\nCalculating score:\n";
     {
         int correct = 0, wrong = 0;
+        std::array<IrisType, 3> results;
         for (const auto &d: test_data) {
-            auto results = net.run({ d.sepal_l,
-                                     d.sepal_w,
-                                     d.petal_l,
-                                     d.petal_w });
+            net.run({ d.sepal_l,
+                      d.sepal_w,
+                      d.petal_l,
+                      d.petal_w }, results);
             int sum = 0;
             for (auto &x : results)
                 x = std::round(x), sum += x;
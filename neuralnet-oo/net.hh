@@ -17,12 +17,43 @@
 #pragma once
 
 // Simple fully connected neural network implementation.
+//
+// A net is built out of Neurons and their links, but it does not run
+// on them: before the first run() or train(), the topology is compiled
+// into flat arrays, one block of weights per layer. A layer whose
+// neurons all take every neuron of one earlier layer as inputs (as in
+// nets made with the layer constructor) becomes a dense row-major
+// matrix; any other (hand-wired) layer is stored in CSR form.
+//
+// The Neurons stay a view on the net: whatever is read through
+// getLayers(), getLayer() or getNeuron() (or operator<<) reflects the
+// values and weights of the last run or training step. Changes made
+// through the non-const accessors (e.g. connect()) take effect at the
+// next run() or train(); call them again after that for further
+// changes, rather than holding on to a neuron.
+//
+// Using a non-const accessor has a cost even if nothing is changed:
+// the next run() or train() rereads all values and weights from the
+// neurons, and compiles the net again only if neurons or links were
+// added or replaced. Read through a const Net to avoid this.
+//
+// The arrays are the net's workspace as well: they are allocated when
+// the net is compiled, after which the span overloads of run() and
+// train() do not allocate any memory (unless it has to be compiled
+// again).
+//
+// With a ThreadPool (see setThreadPool()), the rows of big dense
+// layers are spread over its threads, one layer at a time.
 
 #include "common.hh"
+#include <algorithm>
 #include <vector>
 #include <tuple>
 #include <memory>
+#include <stdexcept>
+#include <unordered_map>
 #include "neuron.hh"
+#include "pool.hh"
 
 namespace nn {
 
@@ -36,7 +67,419 @@ namespace nn {
         using layer_t  = std::vector<Neuron_t>;
 
     private:
-        std::vector<layer_t> layers;
+        // Wiskunde == leesbaar
+        using ActivationPolicy::g;
+        using ActivationPolicy::g_;
+
+        /// The weights of the links into one layer.
+        struct Block {
+            bool dense;
+
+            /// Neurons with inputs (by index in values).
+            uint dst;               ///< Dense: the first one, the rest follow.
+            std::vector<uint> dsts; ///< CSR: all of them.
+            uint rows;
+
+            /// Dense: the inputs of every row (by index in values).
+            uint src;
+            uint cols;
+
+            /// CSR: the inputs of row r are col[row[r]] .. col[row[r+1]-1].
+            std::vector<uint> row;
+            std::vector<uint> col;
+
+            /// Row-major (dense) or in the order of col (CSR).
+            std::vector<T> weights;
+
+            /// Weight changes summed over a batch, in the order of weights.
+            std::vector<T> gradient;
+
+            uint target(uint r) const { return dense ? dst + r : dsts[r]; }
+        };
+
+        mutable std::vector<layer_t> layers;
+
+        // The compiled net. Neurons are numbered layer by layer.
+        std::vector<Block> blocks;     ///< One per layer, except the input layer.
+        std::vector<uint>  offsets;    ///< Number of the first neuron of each layer.
+        std::vector<const Neuron_t*> neurons; ///< The neuron of each number.
+        std::vector<T>     values;
+        std::vector<T>     sums;       ///< Weighted input sums, for training.
+        std::vector<T>     deltas;     ///< Also accumulates deltas from the layers above.
+        std::vector<char>  hasOutputs;
+
+        /// Whether the net has been compiled.
+        bool compiled = false;
+        /// Whether the neurons may have changed since.
+        bool stale = false;
+        /// Whether the neurons are up to date with the compiled net.
+        mutable bool synced = true;
+
+        ThreadPool *pool = nullptr;
+        size_t      parallelThreshold = 0;
+
+        /// Whether to spread the work on a layer over the pool.
+        bool parallel(const Block &b) const {
+            return pool && b.dense && b.weights.size() >= parallelThreshold;
+        }
+
+        /// Call f(begin, end) on chunks of [0, n), on all threads of the pool.
+        template<typename F>
+        void split(uint n, const F &f) {
+            uint chunks = std::min(n, pool->size() * 4);
+            pool->run(chunks, [&](uint i) {
+                f(uint(uint64_t(n) * i / chunks), uint(uint64_t(n) * (i + 1) / chunks));
+            });
+        }
+
+        /// Mark the neurons as (possibly) changed, after syncing them.
+        void touch() {
+            sync();
+            stale = true;
+        }
+
+        /// Build the flat arrays from the neurons and their links.
+        void compile() {
+            std::unordered_map<const Neuron_t*, uint> number;
+
+            offsets.clear();
+            neurons.clear();
+            uint n = 0;
+            for (const auto &layer : layers) {
+                offsets.push_back(n);
+                for (const auto &neuron : layer) {
+                    number[&neuron] = n++;
+                    neurons.push_back(&neuron);
+                }
+            }
+            offsets.push_back(n);
+
+            values.assign(n, 0);
+            sums.assign(n, 0);
+            deltas.assign(n, 0);
+            hasOutputs.assign(n, 0);
+
+            blocks.clear();
+            for (size_t i = 0; i < layers.size(); ++i) {
+                for (size_t j = 0; j < layers[i].size(); ++j) {
+                    const auto &neuron = layers[i][j];
+                    uint k = offsets[i] + j;
+                    values[k] = neuron.value;
+                    sums[k]   = neuron.sum;
+                    hasOutputs[k] = !neuron.outputs.empty();
+                }
+                if (i > 0)
+                    blocks.push_back(compileLayer(i, number));
+            }
+
+            compiled = true;
+            stale    = false;
+            synced   = true;
+        }
+
+        /**
+         * \brief Reread values and weights from the neurons, unless
+         *        the topology is no longer the one that was compiled.
+         *
+         * \return false if the net has to be compiled again. Values and
+         *         weights may have been partly overwritten by then.
+         */
+        bool reload() {
+            if (offsets.size() != layers.size() + 1)
+                return false;
+
+            for (size_t i = 0; i < layers.size(); ++i) {
+                if (layers[i].size() != offsets[i+1] - offsets[i])
+                    return false;
+
+                for (size_t j = 0; j < layers[i].size(); ++j) {
+                    const auto &neuron = layers[i][j];
+                    uint k = offsets[i] + j;
+                    if (neurons[k] != &neuron || hasOutputs[k] != !neuron.outputs.empty())
+                        return false;
+                    values[k] = neuron.value;
+                    sums[k]   = neuron.sum;
+                }
+                if (i == 0)
+                    continue;
+
+                Block &b = blocks[i-1];
+                uint r = 0;
+                for (size_t j = 0; j < layers[i].size(); ++j) {
+                    const auto &inputs = layers[i][j].inputs;
+                    if (inputs.empty())
+                        continue;
+                    if (r == b.rows || b.target(r) != offsets[i] + j)
+                        return false;
+
+                    uint first = b.dense ? r * b.cols : b.row[r];
+                    uint count = b.dense ? b.cols     : b.row[r+1] - b.row[r];
+                    if (inputs.size() != count)
+                        return false;
+                    for (uint c = 0; c < count; ++c) {
+                        uint src = b.dense ? b.src + c : b.col[first + c];
+                        if (neurons[src] != inputs[c]->src)
+                            return false;
+                        b.weights[first + c] = inputs[c]->weight;
+                    }
+                    ++r;
+                }
+                if (r != b.rows)
+                    return false;
+            }
+            stale = false;
+            return true;
+        }
+
+        Block compileLayer(size_t i, const std::unordered_map<const Neuron_t*, uint> &number) const {
+            const layer_t &layer = layers[i];
+
+            Block b;
+            b.rows = 0;
+            b.row.push_back(0);
+
+            for (size_t j = 0; j < layer.size(); ++j) {
+                const auto &inputs = layer[j].inputs;
+                if (inputs.empty())
+                    continue;
+
+                b.dsts.push_back(offsets[i] + j);
+                ++b.rows;
+                for (const auto &l : inputs) {
+                    uint src = number.at(l->src);
+                    if (src >= offsets[i])
+                        throw std::logic_error("Neurons can only take inputs from earlier layers");
+                    b.col.push_back(src);
+                    b.weights.push_back(l->weight);
+                }
+                b.row.push_back(b.col.size());
+            }
+            b.gradient.assign(b.weights.size(), 0);
+
+            // Dense if the neurons with inputs are consecutive, and each
+            // takes all neurons of the same layer, in order.
+            b.dense = b.rows > 0 && b.dsts.back() - b.dsts.front() + 1 == b.rows;
+            if (b.dense) {
+                b.src  = b.col.front();
+                b.cols = b.row[1];
+
+                auto source = std::upper_bound(offsets.begin(), offsets.end(), b.src) - 1;
+                b.dense = b.src == *source && b.cols == *(source + 1) - *source;
+
+                for (uint r = 0; b.dense && r < b.rows; ++r) {
+                    b.dense = b.row[r+1] - b.row[r] == b.cols;
+                    for (uint c = 0; b.dense && c < b.cols; ++c)
+                        b.dense = b.col[b.row[r] + c] == b.src + c;
+                }
+            }
+            if (b.dense) {
+                b.dst = b.dsts.front();
+                b.dsts.clear();
+                b.row.clear();
+                b.col.clear();
+            }
+            return b;
+        }
+
+        /// Copy values and weights back into the neurons.
+        void sync() const {
+            if (synced)
+                return;
+
+            for (size_t i = 0; i < layers.size(); ++i) {
+                for (size_t j = 0; j < layers[i].size(); ++j) {
+                    auto &neuron = layers[i][j];
+                    uint k = offsets[i] + j;
+                    neuron.value = values[k];
+                    neuron.sum   = sums[k];
+                    neuron.delta = deltas[k];
+                }
+                if (i == 0)
+                    continue;
+
+                const Block &b = blocks[i-1];
+                size_t w = 0;
+                for (auto &neuron : layers[i]) {
+                    for (auto &l : neuron.inputs) {
+                        l->weight  = b.weights[w++];
+                        l->weight_ = l->weight;
+                    }
+                }
+            }
+            synced = true;
+        }
+
+        void forward(const Block &b) {
+            if (parallel(b))
+                split(b.rows, [&](uint r0, uint r1) { forward(b, r0, r1); });
+            else
+                forward(b, 0, b.rows);
+        }
+
+        /// Compute rows [r0, r1) of a layer.
+        void forward(const Block &b, uint r0, uint r1) {
+            for (uint r = r0; r < r1; ++r) {
+                T sum = 0;
+                if (b.dense) {
+                    const T *w = &b.weights[size_t(r) * b.cols];
+                    const T *x = &values[b.src];
+                    for (uint c = 0; c < b.cols; ++c)
+                        sum += x[c] * w[c];
+                } else {
+                    for (uint i = b.row[r]; i < b.row[r+1]; ++i)
+                        sum += values[b.col[i]] * b.weights[i];
+                }
+                uint d = b.target(r);
+                sums[d]   = sum;
+                values[d] = g(sum);
+            }
+        }
+
+        /**
+         * \brief Compute the deltas of a layer, pass them on to its
+         *        inputs, and update its weights.
+         *
+         * The deltas of the layers above have already been added to
+         * those of this layer by then. In a Batch, the weight changes
+         * are added to the gradient instead, see step().
+         */
+        template<bool Batch>
+        void backward(Block &b, span<const T> expected, bool output) {
+            if (parallel(b))
+                return backwardParallel<Batch>(b, expected, output);
+
+            for (uint r = 0; r < b.rows; ++r) {
+                uint d = b.target(r);
+                T delta = deltas[d] = computeDelta(d, expected, output);
+
+                if (b.dense) {
+                    T *w  = &b.weights[size_t(r) * b.cols];
+                    T *x  = &values[b.src];
+                    T *dx = &deltas[b.src];
+                    T *dw = &b.gradient[size_t(r) * b.cols];
+                    for (uint c = 0; c < b.cols; ++c) {
+                        dx[c] += w[c] * delta;
+                        if (Batch)
+                            dw[c] += Neuron_t::eta * x[c] * delta;
+                        else
+                            w[c] = w[c] + Neuron_t::eta * x[c] * delta;
+                    }
+                } else {
+                    for (uint i = b.row[r]; i < b.row[r+1]; ++i) {
+                        uint s = b.col[i];
+                        deltas[s] += b.weights[i] * delta;
+                        if (Batch)
+                            b.gradient[i] += Neuron_t::eta * values[s] * delta;
+                        else
+                            b.weights[i] = b.weights[i] + Neuron_t::eta * values[s] * delta;
+                    }
+                }
+            }
+        }
+
+        /// The delta of neuron d, given the sum of those of its outputs.
+        T computeDelta(uint d, span<const T> expected, bool output) {
+            if (hasOutputs[d])
+                return g_(sums[d], values[d]) * deltas[d];
+
+            // Only the neurons of the output layer have an expected value.
+            T y = output ? expected[d - offsets.end()[-2]] : 0;
+            return g_(sums[d], values[d]) * (y - values[d]);
+        }
+
+        /**
+         * \brief backward() for a dense layer, split into passes that
+         *        each are spread over the pool.
+         *
+         * The deltas are passed on to the inputs by column, adding them
+         * up in the same order as backward() does, so the results are
+         * the same.
+         */
+        template<bool Batch>
+        void backwardParallel(Block &b, span<const T> expected, bool output) {
+            for (uint r = 0; r < b.rows; ++r)
+                deltas[b.dst + r] = computeDelta(b.dst + r, expected, output);
+
+            split(b.cols, [&](uint c0, uint c1) {
+                T *dx = &deltas[b.src];
+                for (uint r = 0; r < b.rows; ++r) {
+                    const T *w = &b.weights[size_t(r) * b.cols];
+                    T delta = deltas[b.dst + r];
+                    for (uint c = c0; c < c1; ++c)
+                        dx[c] += w[c] * delta;
+                }
+            });
+
+            split(b.rows, [&](uint r0, uint r1) {
+                const T *x = &values[b.src];
+                for (uint r = r0; r < r1; ++r) {
+                    T  delta = deltas[b.dst + r];
+                    T *w     = &b.weights[size_t(r) * b.cols];
+                    T *dw    = &b.gradient[size_t(r) * b.cols];
+                    for (uint c = 0; c < b.cols; ++c) {
+                        if (Batch)
+                            dw[c] += Neuron_t::eta * x[c] * delta;
+                        else
+                            w[c] = w[c] + Neuron_t::eta * x[c] * delta;
+                    }
+                }
+            });
+        }
+
+        void forward(span<const T> input) {
+            if (!compiled || (stale && !reload()))
+                compile();
+            if (input.size() != layers[0].size() - 1)
+                throw std::invalid_argument("Expected one input value for each input neuron");
+            synced = false;
+
+            // Set input neurons.
+            for (size_t i = 1; i < layers[0].size(); i++)
+                values[i] = input[i-1];
+
+            // propagateForward all other neurons.
+            for (const auto &b : blocks)
+                forward(b);
+        }
+
+        void checkExpected(span<const T> expected) const {
+            if (expected.size() != layers.back().size())
+                throw std::invalid_argument("Expected one value for each output neuron");
+        }
+
+        template<bool Batch>
+        void backward(span<const T> expected) {
+            checkExpected(expected);
+
+            // Deltas are accumulated from the output layer down, so all
+            // of them are computed from the weights before this step.
+            std::fill(deltas.begin(), deltas.end(), 0);
+            for (size_t i = blocks.size(); i-- > 0; )
+                backward<Batch>(blocks[i], expected, i + 1 == blocks.size());
+        }
+
+        /// Apply the mean of the weight changes of a batch of n examples.
+        void step(uint n) {
+            for (auto &b : blocks) {
+                for (size_t i = 0; i < b.weights.size(); ++i) {
+                    b.weights[i] = b.weights[i] + b.gradient[i] / n;
+                    b.gradient[i] = 0;
+                }
+            }
+        }
+
+        /// Squared error of the last run, as in neuralnet-f's get_mse.
+        T loss(span<const T> expected) const {
+            checkExpected(expected);
+
+            uint out = offsets.end()[-2];
+            T sum = 0;
+            for (size_t j = 0; j < expected.size(); ++j) {
+                T d = expected[j] - values[out + j];
+                sum += d * d;
+            }
+            return sum / (2 * expected.size());
+        }
 
     public:
         Net() = default;
@@ -62,12 +505,28 @@ namespace nn {
             connect();
         }
 
+        /**
+         * \brief Spread the work on big layers over the threads of a pool.
+         *
+         * Dense layers with fewer than `threshold` links, and all
+         * hand-wired layers, are still done on the calling thread. The
+         * results are the same with or without a pool.
+         *
+         * \param pool Shared with whoever else uses it (but not at the
+         *             same time), or nullptr to stop using one.
+         */
+        void setThreadPool(ThreadPool *pool, size_t threshold = 1 << 14) {
+            this->pool        = pool;
+            parallelThreshold = threshold;
+        }
+
         struct Connection {
             uint srcL, srcN;
             uint dstL, dstN;
             T weight;
         };
         void connect() {
+            touch();
             for (size_t i = 1; i < layers.size(); ++i) {
                 for (size_t j = (i == layers.size()-1 ? 0 : 1);
                      j < layers[i].size(); ++j) {
@@ -86,66 +545,146 @@ namespace nn {
                 connect(c);
         }
 
-        std::vector<T> run(const std::vector<T> &input) {
-            // Set input neurons.
-            for (size_t i = 1; i < layers[0].size(); i++)
-                layers[0][i].setValue(input[i-1]);
+        /**
+         * \brief Run the net.
+         *
+         * \param input  One value for each input neuron.
+         * \param output Receives the values of the output neurons.
+         */
+        void run(span<const T> input, span<T> output) {
+            if (output.size() != layers.back().size())
+                throw std::invalid_argument("Output buffer does not have one element for each output neuron");
 
-            // propagateForward all other neurons.
-            for (size_t i = 1; i < layers.size(); i++) {
-                for (auto &n : layers[i])
-                    n.propagateForward();
-            }
+            forward(input);
 
             // Collect output values.
-            std::vector<T> res;
-            for (auto &n : layers.back())
-                res.push_back(n.getValue());
+            std::copy(values.begin() + offsets.end()[-2], values.end(), output.begin());
+        }
+
+        std::vector<T> run(span<const T> input) {
+            forward(input);
 
-            return res;
+            return std::vector<T>(values.begin() + offsets.end()[-2], values.end());
         }
 
-        void train(const std::vector<T> &input,
-                   const std::vector<T> &expected) {
+        /**
+         * \brief Run the net and update its weights towards the expected output.
+         *
+         * \param input    One value for each input neuron.
+         * \param expected One value for each output neuron.
+         */
+        void train(span<const T> input,
+                   span<const T> expected) {
 
-            auto results = run(input);
+            forward(input);
+            backward<false>(expected);
+        }
 
-            // T delta = 0;
+        struct Example {
+            std::vector<T> input;
+            std::vector<T> expected;
+        };
 
-            // for (size_t i = 0; i < layers.back().size(); ++i) {
-            //     auto &n = layers.back()[i];
-            //     auto a = n.getValue();
-            //     auto y = expected[i];
-            //     delta += pow(y - a, 2);
-            // }
-            // T mse = delta / (2 * layers.back().size());
-            // std::cout << "MSE:" << mse << "\n";
+        struct FitOptions {
+            /// The part of the examples (taken from the end) that is
+            /// not trained on, but used to decide when to stop.
+            double validation = 0;
 
-            for (int i = layers.size()-1; i >= 0; --i) {
+            /// Stop when the validation loss has not improved for this
+            /// many epochs.
+            uint patience = 10;
+        };
 
-                for (size_t j = 0; j < layers[i].size(); ++j) {
-                    auto &n = layers[i][j];
-                    if (i == (int)layers.size()-1)
-                        n.propagateBackward(expected[j]);
-                    else
-                        n.propagateBackward();
+        struct FitResult {
+            std::vector<T> loss;           ///< Mean training loss of each epoch.
+            std::vector<T> validationLoss; ///< Mean validation loss after each epoch.
+            uint best;                     ///< The epoch whose weights the net ended up with.
+        };
+
+        /**
+         * \brief Train the net on a data set, in batches.
+         *
+         * The weight changes of the examples in a batch are averaged
+         * and applied once at the end of the batch; with a batchSize of
+         * 1, this is the same (up to rounding) as calling train() on
+         * every example.
+         * Examples are used in the order given.
+         *
+         * With a validation split, training stops once the validation
+         * loss has not improved for `patience` epochs, and the net gets
+         * the weights of the best epoch back.
+         *
+         * The training loss of an epoch is measured on each example
+         * just before it is trained on.
+         */
+        FitResult fit(const std::vector<Example> &data,
+                      uint epochs,
+                      uint batchSize = 1,
+                      const FitOptions &options = { }) {
+
+            if (!batchSize)
+                throw std::invalid_argument("Batch size must be at least 1");
+
+            size_t validation = size_t(data.size() * options.validation);
+            size_t training   = data.size() - validation;
+
+            FitResult result;
+            result.best = epochs;
+
+            std::vector<std::vector<T>> best;
+            T bestLoss = 0;
+
+            for (uint epoch = 0; epoch < epochs; ++epoch) {
+                T sum = 0;
+                for (size_t i = 0; i < training; i += batchSize) {
+                    size_t n = std::min<size_t>(batchSize, training - i);
+                    for (size_t j = i; j < i + n; ++j) {
+                        forward(data[j].input);
+                        sum += loss(data[j].expected);
+                        backward<true>(data[j].expected);
+                    }
+                    step(n);
                 }
-            }
+                result.loss.push_back(training ? sum / training : 0);
+
+                if (!validation) {
+                    result.best = epoch + 1;
+                    continue;
+                }
+
+                sum = 0;
+                for (size_t j = training; j < data.size(); ++j) {
+                    forward(data[j].input);
+                    sum += loss(data[j].expected);
+                }
+                result.validationLoss.push_back(sum / validation);
 
-            for (size_t i = 0; i < layers.size(); ++i)
-                for (size_t j = 0; j < layers[i].size(); ++j)
-                    layers[i][j].flush();
+                if (best.empty() || result.validationLoss.back() < bestLoss) {
+                    bestLoss    = result.validationLoss.back();
+                    result.best = epoch + 1;
+                    best.resize(blocks.size());
+                    for (size_t i = 0; i < blocks.size(); ++i)
+                        best[i] = blocks[i].weights;
+                } else if (epoch + 1 - result.best >= options.patience) {
+                    break;
+                }
+            }
 
+            if (!best.empty()) {
+                for (size_t i = 0; i < blocks.size(); ++i)
+                    blocks[i].weights = best[i];
+            }
+            return result;
         }
 
-        const std::vector<layer_t> &getLayers() const { return layers; }
-              std::vector<layer_t> &getLayers()       { return layers; }
+        const std::vector<layer_t> &getLayers() const { sync();  return layers; }
+              std::vector<layer_t> &getLayers()       { touch(); return layers; }
 
-        const layer_t &getLayer(uint layer) const { return layers[layer]; }
-              layer_t &getLayer(uint layer)       { return layers[layer]; }
+        const layer_t &getLayer(uint layer) const { sync();  return layers[layer]; }
+              layer_t &getLayer(uint layer)       { touch(); return layers[layer]; }
 
-        const Neuron_t &getNeuron(uint layer, uint neuron) const { return layers[layer][neuron]; }
-              Neuron_t &getNeuron(uint layer, uint neuron)       { return layers[layer][neuron]; }
+        const Neuron_t &getNeuron(uint layer, uint neuron) const { sync();  return layers[layer][neuron]; }
+              Neuron_t &getNeuron(uint layer, uint neuron)       { touch(); return layers[layer][neuron]; }
     };
 
     template<typename S, typename... N>
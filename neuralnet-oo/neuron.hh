@@ -17,23 +17,57 @@
 #pragma once
 
 #include "common.hh"
+#include <cmath>
 #include <memory>
 #include <ratio>
+#include <vector>
 
 namespace nn {
 
+    /*
+     * An activation policy gives the activation function g(z) of a
+     * neuron and its derivative g_(z, a), where z is the weighted sum of
+     * the neuron's inputs and a = g(z) is its activation, which has
+     * already been computed by then. Derivatives use whichever of the
+     * two is cheapest.
+     */
+
     struct SigmoidActivationPolicy {
         template<typename T>
-        T g(T z)  { return 1 / (1 + exp(-z)); }
+        T g(T z)       { return 1 / (1 + exp(-z)); }
         template<typename T>
-        T g_(T z) { return g(z) * (1 - g(z)); }
+        T g_(T, T a)   { return a * (1 - a); }
     };
 
     struct StepActivationPolicy {
         template<typename T>
-        T g(T z)  { return z > 0; }
+        T g(T z)       { return z > 0; }
+        template<typename T>
+        T g_(T z, T)   { return z*0; }
+    };
+
+    struct TanhActivationPolicy {
+        template<typename T>
+        T g(T z)       { return std::tanh(z); }
+        template<typename T>
+        T g_(T, T a)   { return 1 - a * a; }
+    };
+
+    struct ReluActivationPolicy {
+        template<typename T>
+        T g(T z)       { return z > 0 ? z : 0; }
         template<typename T>
-        T g_(T z) { return z*0; }
+        T g_(T z, T)   { return z > 0; }
+    };
+
+    /// ReLU that lets a little (Slope) through below zero, so that
+    /// neurons cannot get stuck at an activation of 0.
+    template<typename Slope = std::ratio<1,100>>
+    struct LeakyReluActivationPolicy {
+        template<typename T>
+        T g(T z)       { return z > 0 ? z : z * Slope::num / Slope::den; }
+        template<typename T>
+        T g_(T z, T)   { return z > 0 ? T(1) : (T)Slope::num / Slope::den; }
     };
 
     template<typename T = double,
@@ -73,6 +107,10 @@ namespace nn {
         using ActivationPolicy::g;
         using ActivationPolicy::g_;
 
+        // Compiles the neurons of a net into flat arrays, see net.hh.
+        template<typename, typename, typename>
+        friend class Net;
+
     public:
         Neuron(T initialValue = 0)
             : value(initialValue)
@@ -113,10 +151,10 @@ namespace nn {
                 for (auto ol : outputs)
                     sigmaDeltaPAccent += ol->weight * ol->dst->delta;
 
-                delta = g_(sum) * sigmaDeltaPAccent;
+                delta = g_(sum, a) * sigmaDeltaPAccent;
 
             } else {
-                delta = g_(sum) * (y - a);
+                delta = g_(sum, a) * (y - a);
             }
 
             if (inputs.size()) {
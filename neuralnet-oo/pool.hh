@@ -0,0 +1,180 @@
+/* neuralnet-oo - Object oriented neural network
+ * Copyright (C) 2017, Chris Smeele and Jan Halsema.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "common.hh"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nn {
+
+    /**
+     * \brief A fixed set of worker threads that run numbered tasks.
+     *
+     * The tasks of a job are dealt out evenly over the threads. Each
+     * thread runs its own tasks front to back, and then steals from the
+     * back of the others' until none are left. The calling thread takes
+     * part as well, so a pool of size 1 runs everything inline.
+     *
+     * Jobs in a net are short and come in quick succession (one or two
+     * per layer), so workers keep polling for a while before going to
+     * sleep. They yield while they do, so that a busy (or small)
+     * machine still gets to run the thread that has work.
+     */
+    class ThreadPool {
+
+        /// The tasks [lo, hi) of one thread, as lo | hi << 32. Padded to
+        /// keep the queues on separate cache lines.
+        struct Queue {
+            std::atomic<uint64_t> range { 0 };
+            char pad[64 - sizeof(std::atomic<uint64_t>)];
+        };
+
+        std::vector<std::thread> workers;
+        std::unique_ptr<Queue[]> queues; ///< One per thread; the caller has 0.
+
+        std::mutex              mutex;
+        std::condition_variable wake;
+        std::atomic<unsigned long> generation { 0 };
+        std::atomic<uint>          busy       { 0 }; ///< Workers not done with the current job.
+        std::atomic<bool>          stopping   { false };
+
+        // The current job.
+        void      (*call)(const void*, uint) = nullptr;
+        const void *job                      = nullptr;
+
+        /// How often a worker yields while waiting for a job, before it sleeps.
+        static constexpr uint spin = 1 << 10;
+
+        static uint64_t pack(uint64_t lo, uint64_t hi) { return lo | hi << 32; }
+
+        /// Take the first task of a queue (own == true) or the last one.
+        bool take(Queue &q, bool own, uint &task) {
+            uint64_t r = q.range.load(std::memory_order_relaxed);
+            for (;;) {
+                uint lo = uint(r), hi = uint(r >> 32);
+                if (lo >= hi)
+                    return false;
+                uint64_t taken = own ? pack(lo + 1, hi) : pack(lo, hi - 1);
+                if (q.range.compare_exchange_weak(r, taken, std::memory_order_acquire)) {
+                    task = own ? lo : hi - 1;
+                    return true;
+                }
+            }
+        }
+
+        void work(uint self) {
+            uint n = size();
+            uint task;
+            while (take(queues[self], true, task))
+                call(job, task);
+            for (uint i = 1; i < n; ++i) {
+                while (take(queues[(self + i) % n], false, task))
+                    call(job, task);
+            }
+        }
+
+        void worker(uint self) {
+            unsigned long seen = 0;
+            for (;;) {
+                uint i = 0;
+                for (; generation.load(std::memory_order_relaxed) == seen && i < spin; ++i)
+                    std::this_thread::yield();
+                if (i == spin) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [&] { return generation.load() != seen; });
+                }
+                seen = generation.load(std::memory_order_acquire);
+                if (stopping)
+                    return;
+                work(self);
+                busy.fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+        template<typename F>
+        static void invoke(const void *f, uint task) {
+            (*static_cast<const F*>(f))(task);
+        }
+
+    public:
+        /**
+         * \param threads Total amount of threads, including the caller.
+         *                0 means one per hardware thread.
+         */
+        explicit ThreadPool(uint threads = 0) {
+            if (!threads)
+                threads = std::max(1U, std::thread::hardware_concurrency());
+            queues.reset(new Queue[threads]);
+            for (uint i = 1; i < threads; ++i)
+                workers.emplace_back([this, i] { worker(i); });
+        }
+
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+                ++generation;
+            }
+            wake.notify_all();
+            for (auto &t : workers)
+                t.join();
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool &operator=(const ThreadPool&) = delete;
+
+        uint size() const { return workers.size() + 1; }
+
+        /**
+         * \brief Call f(0) .. f(n-1), spread over all threads.
+         *
+         * Returns when all calls have finished. Allocates nothing.
+         */
+        template<typename F>
+        void run(uint n, const F &f) {
+            if (workers.empty() || n <= 1) {
+                for (uint i = 0; i < n; ++i)
+                    f(i);
+                return;
+            }
+
+            uint t = size();
+            for (uint i = 0; i < t; ++i)
+                queues[i].range.store(pack(uint64_t(n) * i / t, uint64_t(n) * (i + 1) / t),
+                                      std::memory_order_relaxed);
+            call = invoke<F>;
+            job  = &f;
+            busy.store(workers.size(), std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                generation.fetch_add(1, std::memory_order_release);
+            }
+            wake.notify_all();
+
+            work(0);
+            while (busy.load(std::memory_order_acquire))
+                std::this_thread::yield();
+        }
+    };
+}